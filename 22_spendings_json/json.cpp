@@ -1,4 +1,9 @@
 #include "json.h"
+#include "../mapped_file.h"
+
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
 
 Node::Node(vector<Node> array) : as_array(move(array)) {
 }
@@ -101,3 +106,101 @@ Document Load(istream& input) {
   return Document{LoadNode(input)};
 }
 
+// Buffer overloads consume the parsed prefix of input
+
+bool ReadChar(string_view& input, char& c) {
+  while (!input.empty() && isspace(input.front())) {
+    input.remove_prefix(1);
+  }
+  if (input.empty()) {
+    return false;
+  }
+  c = input.front();
+  input.remove_prefix(1);
+  return true;
+}
+
+char ReadCharOrThrow(string_view& input) {
+  char c;
+  if (!ReadChar(input, c)) {
+    throw invalid_argument("Unexpected JSON end");
+  }
+  return c;
+}
+
+// Only valid right after a successful read
+void PutBack(string_view& input) {
+  input = {input.data() - 1, input.size() + 1};
+}
+
+Node LoadNode(string_view& input);
+
+Node LoadArray(string_view& input) {
+  vector<Node> result;
+
+  for (char c = ReadCharOrThrow(input); c != ']';
+       c = ReadCharOrThrow(input)) {
+    if (c != ',') {
+      PutBack(input);
+    }
+    result.push_back(LoadNode(input));
+  }
+
+  return Node(move(result));
+}
+
+Node LoadInt(string_view& input) {
+  int result = 0;
+  const char* end = input.data() + input.size();
+  input.remove_prefix(from_chars(input.data(), end, result).ptr - input.data());
+  return Node(result);
+}
+
+Node LoadString(string_view& input) {
+  auto pos = min(input.find('"'), input.size());
+  string line(input.substr(0, pos));
+  input.remove_prefix(min(pos + 1, input.size()));
+  return Node(move(line));
+}
+
+Node LoadDict(string_view& input) {
+  map<string, Node> result;
+
+  for (char c = ReadCharOrThrow(input); c != '}';
+       c = ReadCharOrThrow(input)) {
+    if (c == ',') {
+      ReadCharOrThrow(input);
+    }
+
+    string key = LoadString(input).AsString();
+    ReadCharOrThrow(input);
+    result.insert({move(key), LoadNode(input)});
+  }
+
+  return Node(move(result));
+}
+
+Node LoadNode(string_view& input) {
+  char c = ReadCharOrThrow(input);
+
+  if (c == '[') {
+    return LoadArray(input);
+  } else if (c == '{') {
+    return LoadDict(input);
+  } else if (c == '"') {
+    return LoadString(input);
+  } else {
+    PutBack(input);
+    return LoadInt(input);
+  }
+}
+
+Document LoadFromBuffer(string_view input) {
+  return Document{LoadNode(input)};
+}
+
+Document LoadFromFile(const string& path) {
+  MappedFile file(path);
+  return LoadFromBuffer(file.Data());
+}
+
@@ -3,6 +3,7 @@
 #include <istream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <map>
 using namespace std;
@@ -37,4 +38,6 @@ private:
 };
 
 Document Load(istream& input);
+Document LoadFromBuffer(string_view input);
+Document LoadFromFile(const string& path);
 
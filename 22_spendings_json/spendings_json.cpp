@@ -4,6 +4,8 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
+#include <string_view>
 #include <vector>
 using namespace std;
 
@@ -107,8 +109,35 @@ void TestJsonLibrary() {
   ASSERT_EQUAL(array_node.AsArray().size(), 1u);
 }
 
+void TestLoadFromBuffer() {
+  const string json_input = R"([
+    {"amount": 2500, "category": "food"},
+    {"amount": 12000, "category": "sport"}
+  ])";
+
+  Document doc = LoadFromBuffer(json_input);
+  const vector<Node>& root = doc.GetRoot().AsArray();
+  ASSERT_EQUAL(root.size(), 2u);
+  ASSERT_EQUAL(root.front().AsMap().at("category").AsString(), "food");
+  ASSERT_EQUAL(root.front().AsMap().at("amount").AsInt(), 2500);
+  ASSERT_EQUAL(root.back().AsMap().at("category").AsString(), "sport");
+  ASSERT_EQUAL(root.back().AsMap().at("amount").AsInt(), 12000);
+}
+
+void TestLoadFromBufferTruncated() {
+  for (string_view json_input : {"", "  ", "[", "{", "[1,", "{\"a\":"}) {
+    try {
+      LoadFromBuffer(json_input);
+      ASSERT(false);
+    } catch (invalid_argument&) {
+    }
+  }
+}
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestJsonLibrary);
   RUN_TEST(tr, TestLoadFromJson);
+  RUN_TEST(tr, TestLoadFromBuffer);
+  RUN_TEST(tr, TestLoadFromBufferTruncated);
 }
@@ -3,6 +3,7 @@
 #include <istream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <map>
 
@@ -38,5 +39,7 @@ private:
 };
 
 Document Load(std::istream& input);
+Document LoadFromBuffer(std::string_view input);
+Document LoadFromFile(const std::string& path);
 
 }
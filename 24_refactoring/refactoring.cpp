@@ -1,5 +1,7 @@
 #include <map>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "json.h"
@@ -111,9 +113,27 @@ void TestJsonToXml() {
   }
 }
 
+void TestLoadFromBuffer() {
+  const auto doc = Json::LoadFromBuffer(
+      R"([{"amount": 2500, "category": "food"}, {"amount": 1150}])");
+  const auto& root = doc.GetRoot().AsArray();
+  ASSERT_EQUAL(root.size(), 2u);
+  ASSERT_EQUAL(root[0].AsMap().at("category").AsString(), "food");
+  ASSERT_EQUAL(root[1].AsMap().at("amount").AsInt(), 1150);
+
+  for (std::string_view json_input : {"", "[", "{", "[1,", "{\"a\":"}) {
+    try {
+      Json::LoadFromBuffer(json_input);
+      ASSERT(false);
+    } catch (std::invalid_argument&) {
+    }
+  }
+}
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestXmlToJson);
   RUN_TEST(tr, TestJsonToXml);
+  RUN_TEST(tr, TestLoadFromBuffer);
   return 0;
 }
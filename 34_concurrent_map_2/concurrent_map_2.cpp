@@ -1,8 +1,16 @@
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <future>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <numeric>
 #include <random>
+#include <shared_mutex>
+#include <stdexcept>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -12,58 +20,450 @@
 
 using namespace std;
 
-template <typename K, typename V, typename Hash = std::hash<K>>
+// Alignment that keeps data used by different threads on different cache
+// lines
+constexpr size_t kCacheLineSize = hardware_destructive_interference_size;
+
+// Storage of ConcurrentMap: buckets of unordered_map under locks, or, for
+// integral keys and atomic values, a lock-free open-addressing table
+struct Locking {};
+struct LockFree {};
+
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename Storage = Locking>
 class ConcurrentMap {
  public:
   using MapType = unordered_map<K, V, Hash>;
 
   struct WriteAccess {
-    lock_guard<mutex> lg;
+    lock_guard<shared_mutex> lg;
     V& ref_to_value;
   };
 
+  // Readers of a bucket share its lock and only wait for writers
   struct ReadAccess {
-    lock_guard<mutex> lg;
+    shared_lock<shared_mutex> lg;
     const V& ref_to_value;
   };
 
-  explicit ConcurrentMap(size_t bucket_count)
-      : value_vec(bucket_count), mutex_vec(bucket_count) {}
+  enum class SnapshotMode {
+    // Every bucket as of the moment it is copied, as BuildOrdinaryMap()
+    PerBucket,
+    // All buckets as of the start of the call. Writers are not stopped,
+    // the first write to a bucket that is not copied yet saves its contents
+    Consistent,
+  };
+
+  explicit ConcurrentMap(size_t bucket_count) : buckets(bucket_count) {}
 
   WriteAccess operator[](const K& key) {
-    size_t index = hasher(key) % value_vec.size();
-    return {lock_guard(mutex_vec[index]), value_vec[index][key]};
+    Bucket& bucket = GetBucket(key);
+    // The lock is taken before Writable, list initialization is in order
+    return {lock_guard(bucket.m), bucket.Writable(snapshot->epoch)[key]};
   }
 
   ReadAccess At(const K& key) const {
-    size_t index = hasher(key) % value_vec.size();
-    return {lock_guard(mutex_vec[index]), value_vec[index].at(key)};
+    const Bucket& bucket = GetBucket(key);
+    return {shared_lock(bucket.m), bucket.map.at(key)};
   }
 
   bool Has(const K& key) const {
-    size_t index = hasher(key) % value_vec.size();
-    auto lg = lock_guard(mutex_vec[index]);
-    const MapType& current = value_vec[index];
-    return current.find(key) != current.end();
+    const Bucket& bucket = GetBucket(key);
+    auto lg = shared_lock(bucket.m);
+    return bucket.map.find(key) != bucket.map.end();
   }
 
   MapType BuildOrdinaryMap() const {
     MapType assembled;
-    for (auto i = 0; i < value_vec.size(); ++i) {
-      auto lg = lock_guard(mutex_vec[i]);
-      assembled.insert(value_vec[i].begin(), value_vec[i].end());
+    for (const Bucket& bucket : buckets) {
+      auto lg = shared_lock(bucket.m);
+      assembled.insert(bucket.map.begin(), bucket.map.end());
+    }
+    return assembled;
+  }
+
+  // Buckets are copied by thread_count threads and then spliced into a map
+  // reserved for all of them. Consistent snapshots run one at a time.
+  MapType BuildOrdinaryMap(size_t thread_count, SnapshotMode mode) const {
+    unique_lock<mutex> snapshot_lg;
+    uint64_t epoch = 0;
+    if (mode == SnapshotMode::Consistent) {
+      snapshot_lg = unique_lock(snapshot->m);
+      epoch = ++snapshot->last_epoch;
+      snapshot->epoch.store(epoch);
+    }
+
+    vector<MapType> copies(buckets.size());
+    auto copy_slice = [this, &copies, epoch](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        copies[i] = epoch ? buckets[i].TakeSnapshot(epoch)
+                          : buckets[i].CopyMap();
+      }
+    };
+    const size_t slice_size =
+        max<size_t>(1, (buckets.size() + thread_count - 1) /
+                           max<size_t>(thread_count, 1));
+    vector<future<void>> futures;
+    for (size_t begin = 0; begin < buckets.size(); begin += slice_size) {
+      futures.push_back(async(launch::async, copy_slice, begin,
+                              min(begin + slice_size, buckets.size())));
+    }
+    for (auto& f : futures) {
+      f.get();
+    }
+    if (epoch) {
+      snapshot->epoch.store(0);
+    }
+
+    size_t total = 0;
+    for (const auto& copy : copies) {
+      total += copy.size();
+    }
+    MapType assembled;
+    assembled.reserve(total);
+    for (auto& copy : copies) {
+      assembled.merge(copy);
     }
     return assembled;
   }
 
  private:
+  // A lock next to the map it guards, on cache lines of its own, so that
+  // threads working on neighbouring buckets do not false-share
+  struct alignas(kCacheLineSize) Bucket {
+    mutable shared_mutex m;
+    MapType map;
+    // Contents as of the start of snapshot saved_epoch, kept by a writer
+    // that came before the snapshot copied the bucket. Guarded by m.
+    mutable MapType saved;
+    mutable uint64_t saved_epoch = 0;
+
+    // Called under the exclusive lock before every write
+    MapType& Writable(const atomic<uint64_t>& snapshot_epoch) {
+      uint64_t epoch = snapshot_epoch.load(memory_order_acquire);
+      if (epoch > saved_epoch) {
+        saved = map;
+        saved_epoch = epoch;
+      }
+      return map;
+    }
+
+    MapType CopyMap() const {
+      auto lg = shared_lock(m);
+      return map;
+    }
+
+    MapType TakeSnapshot(uint64_t epoch) const {
+      auto lg = lock_guard(m);
+      if (saved_epoch == epoch) {
+        return exchange(saved, MapType());
+      }
+      saved_epoch = epoch;
+      return map;
+    }
+  };
+
+  Bucket& GetBucket(const K& key) {
+    return buckets[hasher(key) % buckets.size()];
+  }
+
+  const Bucket& GetBucket(const K& key) const {
+    return buckets[hasher(key) % buckets.size()];
+  }
+
   Hash hasher;
-  vector<MapType> value_vec;
-  mutable vector<mutex> mutex_vec;
+  vector<Bucket> buckets;
+
+  // Behind a pointer so that the map stays movable
+  struct SnapshotState {
+    mutex m;
+    uint64_t last_epoch = 0;
+    // Epoch of the running consistent snapshot, 0 when there is none
+    atomic<uint64_t> epoch = 0;
+  };
+  unique_ptr<SnapshotState> snapshot = make_unique<SnapshotState>();
 };
 
-void RunConcurrentUpdates(ConcurrentMap<int, int>& cm, size_t thread_count,
-                          int key_count) {
+// Finalizer of MurmurHash3. Spreads hashes such as the identity hash of
+// integers over all bits, so that both low and high bits can pick a slot.
+uint64_t MixHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Keys are spread over a fixed number of lock stripes by the high bits of
+// the mixed hash. Every stripe owns a chained table indexed by the low bits
+// and doubles it on its own, so stripes resize concurrently. A resize is
+// incremental: the old table is kept and every update under the stripe lock
+// moves a few of its buckets, so no single call rehashes the whole stripe.
+// Values live in nodes and stay in place while the table grows.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class StripedConcurrentMap {
+ public:
+  using MapType = unordered_map<K, V, Hash>;
+
+  struct WriteAccess {
+    unique_lock<shared_mutex> lg;
+    V& ref_to_value;
+  };
+
+  struct ReadAccess {
+    shared_lock<shared_mutex> lg;
+    const V& ref_to_value;
+  };
+
+  explicit StripedConcurrentMap(size_t stripe_count,
+                                size_t initial_bucket_count = 8)
+      : stripes(max<size_t>(stripe_count, 1)) {
+    size_t bucket_count = 1;
+    while (bucket_count < initial_bucket_count) {
+      bucket_count *= 2;
+    }
+    for (auto& stripe : stripes) {
+      stripe.buckets.resize(bucket_count);
+    }
+  }
+
+  WriteAccess operator[](const K& key) {
+    const uint64_t h = MixHash(hasher(key));
+    Stripe& stripe = GetStripe(h);
+    unique_lock lg(stripe.m);
+    stripe.Migrate(kMigrationStep);
+    if (Node* node = stripe.Find(key, h)) {
+      return {move(lg), node->value};
+    }
+    if (stripe.size >= stripe.buckets.size()) {
+      stripe.Grow();
+    }
+    auto& head = stripe.buckets[h & (stripe.buckets.size() - 1)];
+    head = make_unique<Node>(Node{key, V(), h, move(head)});
+    ++stripe.size;
+    return {move(lg), head->value};
+  }
+
+  ReadAccess At(const K& key) const {
+    const uint64_t h = MixHash(hasher(key));
+    const Stripe& stripe = GetStripe(h);
+    shared_lock lg(stripe.m);
+    if (const Node* node = stripe.Find(key, h)) {
+      return {move(lg), node->value};
+    }
+    throw out_of_range("StripedConcurrentMap::At");
+  }
+
+  bool Has(const K& key) const {
+    const uint64_t h = MixHash(hasher(key));
+    const Stripe& stripe = GetStripe(h);
+    shared_lock lg(stripe.m);
+    return stripe.Find(key, h) != nullptr;
+  }
+
+  MapType BuildOrdinaryMap() const {
+    MapType assembled;
+    for (const Stripe& stripe : stripes) {
+      shared_lock lg(stripe.m);
+      for (const auto* table : {&stripe.old_buckets, &stripe.buckets}) {
+        for (const auto& head : *table) {
+          for (const Node* node = head.get(); node; node = node->next.get()) {
+            assembled.emplace(node->key, node->value);
+          }
+        }
+      }
+    }
+    return assembled;
+  }
+
+ private:
+  static constexpr size_t kMigrationStep = 4;
+
+  struct Node {
+    K key;
+    V value;
+    uint64_t hash;
+    unique_ptr<Node> next;
+  };
+
+  using Table = vector<unique_ptr<Node>>;
+
+  struct alignas(kCacheLineSize) Stripe {
+    mutable shared_mutex m;
+    Table buckets;
+    // Buckets of the table before the last doubling, the first migrated of
+    // them are already empty
+    Table old_buckets;
+    size_t migrated = 0;
+    size_t size = 0;
+
+    Node* Find(const K& key, uint64_t h) const {
+      for (const Table* table : {&buckets, &old_buckets}) {
+        if (table->empty()) {
+          continue;
+        }
+        Node* node = (*table)[h & (table->size() - 1)].get();
+        for (; node; node = node->next.get()) {
+          if (node->hash == h && node->key == key) {
+            return node;
+          }
+        }
+      }
+      return nullptr;
+    }
+
+    void Migrate(size_t bucket_count) {
+      for (; bucket_count > 0 && migrated < old_buckets.size();
+           --bucket_count, ++migrated) {
+        auto node = move(old_buckets[migrated]);
+        while (node) {
+          auto next = move(node->next);
+          auto& head = buckets[node->hash & (buckets.size() - 1)];
+          node->next = move(head);
+          head = move(node);
+          node = move(next);
+        }
+      }
+      if (!old_buckets.empty() && migrated == old_buckets.size()) {
+        Table().swap(old_buckets);
+      }
+    }
+
+    void Grow() {
+      Migrate(old_buckets.size());
+      old_buckets = move(buckets);
+      buckets = Table(old_buckets.size() * 2);
+      migrated = 0;
+    }
+  };
+
+  Stripe& GetStripe(uint64_t h) {
+    return stripes[(h >> 32) % stripes.size()];
+  }
+
+  const Stripe& GetStripe(uint64_t h) const {
+    return stripes[(h >> 32) % stripes.size()];
+  }
+
+  Hash hasher;
+  vector<Stripe> stripes;
+};
+
+// Linear probing over a fixed number of slots. A key is claimed by CAS on
+// an empty slot and never moves or leaves, values are atomics that callers
+// update in place, for example with ++ or fetch_add. One key value marks
+// empty slots, so that key lives in a slot of its own outside the table.
+template <typename K, typename V, typename Hash>
+class ConcurrentMap<K, V, Hash, LockFree> {
+  static_assert(is_integral_v<K>, "LockFree storage needs integral keys");
+  static_assert(is_trivially_copyable_v<V>,
+                "LockFree storage needs values that fit an atomic");
+
+ public:
+  using MapType = unordered_map<K, V, Hash>;
+
+  struct WriteAccess {
+    atomic<V>& ref_to_value;
+  };
+
+  struct ReadAccess {
+    const atomic<V>& ref_to_value;
+  };
+
+  // Fits at least capacity keys. The table gets 2 * capacity slots rounded
+  // up to a power of two to keep probes short, and operator[] throws
+  // length_error only once every slot is taken. The empty-slot key is
+  // stored outside and never takes a slot.
+  explicit ConcurrentMap(size_t capacity) {
+    size_t slot_count = 2;
+    while (slot_count < 2 * capacity) {
+      slot_count *= 2;
+    }
+    slots = vector<Slot>(slot_count);
+  }
+
+  WriteAccess operator[](const K& key) {
+    if (key == kEmpty) {
+      empty_key_used.store(true, memory_order_release);
+      return {empty_key_slot.value};
+    }
+    size_t index = MixHash(hasher(key));
+    for (size_t probe = 0; probe < slots.size(); ++probe, ++index) {
+      Slot& slot = slots[index & (slots.size() - 1)];
+      K current = slot.key.load(memory_order_acquire);
+      if (current == kEmpty &&
+          slot.key.compare_exchange_strong(current, key,
+                                           memory_order_acq_rel)) {
+        return {slot.value};
+      }
+      if (current == key) {
+        return {slot.value};
+      }
+    }
+    throw length_error("ConcurrentMap<LockFree> is full");
+  }
+
+  ReadAccess At(const K& key) const {
+    if (const Slot* slot = Find(key)) {
+      return {slot->value};
+    }
+    throw out_of_range("ConcurrentMap<LockFree>::At");
+  }
+
+  bool Has(const K& key) const {
+    return Find(key) != nullptr;
+  }
+
+  MapType BuildOrdinaryMap() const {
+    MapType assembled;
+    for (const Slot& slot : slots) {
+      K key = slot.key.load(memory_order_acquire);
+      if (key != kEmpty) {
+        assembled.emplace(key, slot.value.load());
+      }
+    }
+    if (empty_key_used.load(memory_order_acquire)) {
+      assembled.emplace(kEmpty, empty_key_slot.value.load());
+    }
+    return assembled;
+  }
+
+ private:
+  static constexpr K kEmpty = numeric_limits<K>::min();
+
+  struct Slot {
+    atomic<K> key = kEmpty;
+    atomic<V> value = V();
+  };
+
+  const Slot* Find(const K& key) const {
+    if (key == kEmpty) {
+      return empty_key_used.load(memory_order_acquire) ? &empty_key_slot
+                                                       : nullptr;
+    }
+    size_t index = MixHash(hasher(key));
+    for (size_t probe = 0; probe < slots.size(); ++probe, ++index) {
+      const Slot& slot = slots[index & (slots.size() - 1)];
+      K current = slot.key.load(memory_order_acquire);
+      if (current == key) {
+        return &slot;
+      }
+      if (current == kEmpty) {
+        break;
+      }
+    }
+    return nullptr;
+  }
+
+  Hash hasher;
+  vector<Slot> slots;
+  Slot empty_key_slot;
+  atomic<bool> empty_key_used = false;
+};
+
+template <typename Map>
+void RunConcurrentUpdates(Map& cm, size_t thread_count, int key_count) {
   auto kernel = [&cm, key_count](int seed) {
     vector<int> updates(key_count);
     iota(begin(updates), end(updates), -key_count / 2);
@@ -242,6 +642,291 @@ void TestHas() {
   ASSERT(!const_map.Has(3));
 }
 
+void TestStripedConcurrentUpdate() {
+  const size_t thread_count = 4;
+  const size_t key_count = 50000;
+
+  // Tables of every stripe grow many times during the updates
+  StripedConcurrentMap<int, int> cm(3, 1);
+  RunConcurrentUpdates(cm, thread_count, key_count);
+
+  const auto result = std::as_const(cm).BuildOrdinaryMap();
+  ASSERT_EQUAL(result.size(), key_count);
+  for (auto& [k, v] : result) {
+    AssertEqual(v, 8, "Key = " + to_string(k));
+  }
+}
+
+void TestStripedAccess() {
+  StripedConcurrentMap<Point, size_t, PointHash> cm(2);
+  for (int i = 0; i < 1000; ++i) {
+    cm[Point{i, -i}].ref_to_value = i;
+  }
+
+  const auto& const_map = std::as_const(cm);
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT(const_map.Has(Point{i, -i}));
+    ASSERT_EQUAL(const_map.At(Point{i, -i}).ref_to_value, size_t(i));
+  }
+  ASSERT(!const_map.Has(Point{1, 1}));
+  try {
+    const_map.At(Point{1, 1});
+    ASSERT(false);
+  } catch (out_of_range&) {
+  }
+  ASSERT_EQUAL(const_map.BuildOrdinaryMap().size(), size_t(1000));
+}
+
+// All threads update the same keys, one unordered_map per lock against
+// stripes with their own growing tables
+void BenchmarkStripedContention() {
+  const int key_count = 20000;
+  for (size_t thread_count : {1, 2, 4, 8, 16, 32, 64}) {
+    const string threads = to_string(thread_count) + " threads";
+    {
+      ConcurrentMap<int, int> cm(64);
+      LOG_DURATION("ConcurrentMap, " + threads);
+      RunConcurrentUpdates(cm, thread_count, key_count);
+    }
+    {
+      StripedConcurrentMap<int, int> cm(64);
+      LOG_DURATION("StripedConcurrentMap, " + threads);
+      RunConcurrentUpdates(cm, thread_count, key_count);
+    }
+  }
+}
+
+void TestLockFreeConcurrentUpdate() {
+  const size_t thread_count = 4;
+  const size_t key_count = 50000;
+
+  ConcurrentMap<int, int, hash<int>, LockFree> cm(key_count);
+  RunConcurrentUpdates(cm, thread_count, key_count);
+
+  const auto result = std::as_const(cm).BuildOrdinaryMap();
+  ASSERT_EQUAL(result.size(), key_count);
+  for (auto& [k, v] : result) {
+    AssertEqual(v, 8, "Key = " + to_string(k));
+  }
+}
+
+void TestLockFreeAccess() {
+  ConcurrentMap<long, unsigned, hash<long>, LockFree> cm(4);
+  const long min_key = numeric_limits<long>::min();
+  cm[min_key].ref_to_value = 1;
+  cm[0].ref_to_value.fetch_add(2);
+  cm[-5].ref_to_value++;
+  cm[7];
+
+  const auto& const_map = std::as_const(cm);
+  ASSERT(const_map.Has(min_key));
+  ASSERT(const_map.Has(7));
+  ASSERT(!const_map.Has(8));
+  ASSERT_EQUAL(const_map.At(0).ref_to_value.load(), 2u);
+  try {
+    const_map.At(8);
+    ASSERT(false);
+  } catch (out_of_range&) {
+  }
+
+  const unordered_map<long, unsigned> expected = {
+      {min_key, 1}, {0, 2}, {-5, 1}, {7, 0}};
+  ASSERT_EQUAL(const_map.BuildOrdinaryMap(), expected);
+
+  // Capacity 4 gives 8 slots. Only 3 of them are taken already, because
+  // min_key has its own slot outside the table
+  try {
+    for (long key = 1; key <= 8; ++key) {
+      cm[key];
+    }
+    ASSERT(false);
+  } catch (length_error&) {
+  }
+}
+
+void BenchmarkLockFreeUpdates() {
+  const int key_count = 50000;
+  for (size_t thread_count : {1, 4, 16}) {
+    const string threads = to_string(thread_count) + " threads";
+    {
+      ConcurrentMap<int, int> cm(100);
+      LOG_DURATION("Locking, " + threads);
+      RunConcurrentUpdates(cm, thread_count, key_count);
+    }
+    {
+      ConcurrentMap<int, int, hash<int>, LockFree> cm(key_count);
+      LOG_DURATION("LockFree, " + threads);
+      RunConcurrentUpdates(cm, thread_count, key_count);
+    }
+  }
+}
+
+// 95% of the operations read with At, 5% update. Reading through
+// operator[] instead shows the same mix with an exclusive lock per read.
+template <typename Map>
+void RunReadMostly(Map& cm, size_t thread_count, int key_count,
+                   bool shared_reads) {
+  const int ops_count = 200000;
+  auto kernel = [&cm, key_count, shared_reads](int seed) {
+    default_random_engine gen(seed);
+    uniform_int_distribution<int> key_dis(0, key_count - 1);
+    uniform_int_distribution<int> op_dis(0, 99);
+    int64_t sum = 0;
+    for (int i = 0; i < ops_count; ++i) {
+      int key = key_dis(gen);
+      if (op_dis(gen) < 5) {
+        cm[key].ref_to_value++;
+      } else if (shared_reads) {
+        sum += std::as_const(cm).At(key).ref_to_value;
+      } else {
+        sum += cm[key].ref_to_value;
+      }
+    }
+    return sum;
+  };
+
+  vector<future<int64_t>> futures;
+  for (size_t i = 0; i < thread_count; ++i) {
+    futures.push_back(async(launch::async, kernel, i));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+}
+
+void TestSharedReads() {
+  ConcurrentMap<int, int> cm(1);
+  cm[1].ref_to_value = 10;
+
+  // A second reader gets in while the first one holds its access
+  auto first = std::as_const(cm).At(1);
+  auto second = async(launch::async, [&cm] {
+    return std::as_const(cm).At(1).ref_to_value + (cm.Has(2) ? 1 : 0);
+  });
+  ASSERT(second.wait_for(1s) == future_status::ready);
+  ASSERT_EQUAL(second.get(), first.ref_to_value);
+}
+
+void BenchmarkReadMostly() {
+  const int key_count = 1000;
+  for (size_t thread_count : {1, 4, 16}) {
+    for (bool shared_reads : {false, true}) {
+      ConcurrentMap<int, int> cm(4);
+      for (int key = 0; key < key_count; ++key) {
+        cm[key].ref_to_value = key;
+      }
+      LOG_DURATION(to_string(thread_count) + " threads, " +
+                   (shared_reads ? "shared" : "exclusive") + " reads");
+      RunReadMostly(cm, thread_count, key_count, shared_reads);
+    }
+  }
+}
+
+// Every thread updates a key in a bucket of its own, so threads interfere
+// only through the memory layout. The same updates on packed vectors of
+// locks and maps show what false sharing costs.
+void BenchmarkFalseSharing() {
+  const int updates_count = 200000;
+  for (int thread_count : {4, 16, 64}) {
+    const string threads = to_string(thread_count) + " threads";
+    {
+      vector<shared_mutex> locks(thread_count);
+      vector<unordered_map<int, int>> maps(thread_count);
+      LOG_DURATION("Packed buckets, " + threads);
+      vector<future<void>> futures;
+      for (int t = 0; t < thread_count; ++t) {
+        futures.push_back(async(launch::async, [&locks, &maps, t] {
+          for (int i = 0; i < updates_count; ++i) {
+            lock_guard lg(locks[t]);
+            maps[t][t]++;
+          }
+        }));
+      }
+    }
+    {
+      ConcurrentMap<int, int> cm(thread_count);
+      LOG_DURATION("Padded buckets, " + threads);
+      vector<future<void>> futures;
+      for (int t = 0; t < thread_count; ++t) {
+        futures.push_back(async(launch::async, [&cm, t] {
+          for (int i = 0; i < updates_count; ++i) {
+            cm[t].ref_to_value++;
+          }
+        }));
+      }
+    }
+  }
+}
+
+using SnapshotMode = ConcurrentMap<int, int>::SnapshotMode;
+
+void TestParallelSnapshot() {
+  ConcurrentMap<int, int> cm(7);
+  for (int i = 0; i < 10000; ++i) {
+    cm[i * 3].ref_to_value = i;
+  }
+  const auto& const_map = std::as_const(cm);
+  const auto expected = const_map.BuildOrdinaryMap();
+  for (size_t thread_count : {1, 3, 16}) {
+    for (auto mode : {SnapshotMode::PerBucket, SnapshotMode::Consistent}) {
+      ASSERT_EQUAL(const_map.BuildOrdinaryMap(thread_count, mode), expected);
+    }
+  }
+}
+
+void TestConsistentSnapshot() {
+  // The writer increments keys 0, 1, ... in order, so at any moment values
+  // do not grow with the key and differ by at most one
+  const int key_count = 100000;
+  ConcurrentMap<int, int> cm(16);
+  for (int key = 0; key < key_count; ++key) {
+    cm[key];
+  }
+
+  atomic<bool> done = false;
+  auto writer = async(launch::async, [&cm, &done] {
+    while (!done) {
+      for (int key = 0; key < key_count; ++key) {
+        cm[key].ref_to_value++;
+      }
+    }
+  });
+
+  // Failed checks are counted, so that the writer is always stopped
+  int broken_count = 0;
+  for (int i = 0; i < 20; ++i) {
+    auto snapshot = cm.BuildOrdinaryMap(4, SnapshotMode::Consistent);
+    bool consistent = snapshot.size() == size_t(key_count) &&
+                      snapshot[0] - snapshot[key_count - 1] <= 1;
+    for (int key = 1; key < key_count; ++key) {
+      consistent = consistent && snapshot[key] <= snapshot[key - 1];
+    }
+    broken_count += consistent ? 0 : 1;
+  }
+  done = true;
+  writer.get();
+  ASSERT_EQUAL(broken_count, 0);
+}
+
+void BenchmarkSnapshot() {
+  const int key_count = 2'000'000;
+  ConcurrentMap<int, int> cm(256);
+  for (int key = 0; key < key_count; ++key) {
+    cm[key].ref_to_value = key;
+  }
+  const auto& const_map = std::as_const(cm);
+  {
+    LOG_DURATION("Serial snapshot");
+    ASSERT_EQUAL(const_map.BuildOrdinaryMap().size(), size_t(key_count));
+  }
+  for (auto mode : {SnapshotMode::PerBucket, SnapshotMode::Consistent}) {
+    LOG_DURATION(mode == SnapshotMode::PerBucket ? "Parallel snapshot"
+                                                 : "Consistent snapshot");
+    ASSERT_EQUAL(const_map.BuildOrdinaryMap(4, mode).size(),
+                 size_t(key_count));
+  }
+}
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestConcurrentUpdate);
@@ -251,4 +936,16 @@ int main() {
   RUN_TEST(tr, TestStringKeys);
   RUN_TEST(tr, TestUserType);
   RUN_TEST(tr, TestHas);
+  RUN_TEST(tr, TestStripedConcurrentUpdate);
+  RUN_TEST(tr, TestStripedAccess);
+  RUN_TEST(tr, BenchmarkStripedContention);
+  RUN_TEST(tr, TestSharedReads);
+  RUN_TEST(tr, BenchmarkReadMostly);
+  RUN_TEST(tr, BenchmarkFalseSharing);
+  RUN_TEST(tr, TestLockFreeConcurrentUpdate);
+  RUN_TEST(tr, TestLockFreeAccess);
+  RUN_TEST(tr, BenchmarkLockFreeUpdates);
+  RUN_TEST(tr, TestParallelSnapshot);
+  RUN_TEST(tr, TestConsistentSnapshot);
+  RUN_TEST(tr, BenchmarkSnapshot);
 }
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <array>
+#include <future>
 #include <memory>
 #include <string>
+#include <vector>
 
 // Интерфейс, представляющий книгу
 class IBook {
@@ -21,7 +24,8 @@ class IBooksUnpacker {
 public:
   virtual ~IBooksUnpacker() = default;
 
-  // Распаковывает книгу с указанным названием из хранилища
+  // Распаковывает книгу с указанным названием из хранилища. Кэш может
+  // вызывать метод одновременно из нескольких потоков для разных книг
   virtual std::unique_ptr<IBook> UnpackBook(const std::string& book_name) = 0;
 };
 
@@ -30,23 +34,88 @@ class ICache {
 public:
   // Настройки кэша
   struct Settings {
+    // Стратегия выбора книги, которая удаляется из кэша первой
+    enum class Policy {
+      // Книга, к которой дольше всего не обращались
+      Lru,
+      // Книга с наименьшим числом обращений, среди них — дольше всего
+      // не запрашивавшаяся
+      Lfu,
+      // Алгоритм 2Q: книга впервые попадает в очередь новых и переходит
+      // в основную очередь LRU, только если её запросили снова вскоре после
+      // вытеснения. Однократный просмотр множества книг не вытесняет часто
+      // запрашиваемые
+      TwoQueue,
+    };
+
     // Максимальный допустимый объём памяти, потребляемый закэшированными
     // объектами, в байтах
     size_t max_memory = 0;
+
+    // Число независимых частей кэша. Каждая часть хранит свою долю книг
+    // под своим мьютексом и получает свою долю max_memory, так что общий
+    // объём по-прежнему не превосходит max_memory
+    size_t shard_count = 1;
+
+    // Стратегия вытеснения, при любой из них объём книг в кэше
+    // не превосходит max_memory
+    Policy policy = Policy::Lru;
+
+    // Наибольшее число потоков, распаковывающих книги для GetBookAsync
+    // и Prefetch. Остальные книги ждут в очереди, пока поток не освободится
+    size_t unpack_threads = 4;
   };
 
   using BookPtr = std::shared_ptr<const IBook>;
 
+  // Статистика работы кэша. Счётчики обновляются независимо, поэтому при
+  // одновременных запросах снимок может сочетать значения из немного разных
+  // моментов времени
+  struct Stats {
+    // Запросы, для которых книга уже была в кэше
+    size_t hits = 0;
+    // Запросы, которые начали распаковку книги
+    size_t misses = 0;
+    // Запросы, которые дождались уже идущей распаковки той же книги
+    size_t coalesced_misses = 0;
+    // Число удалённых из кэша книг и их общий размер в байтах
+    size_t evictions = 0;
+    size_t evicted_bytes = 0;
+    // Текущие объём книг в кэше в байтах и их число
+    size_t memory = 0;
+    size_t entries = 0;
+
+    // unpack_time[0] — число распаковок короче микросекунды, unpack_time[i] —
+    // длившихся от 2^(i-1) до 2^i микросекунд. Последний элемент учитывает
+    // и все более долгие распаковки
+    static constexpr size_t kUnpackTimeBuckets = 24;
+    std::array<size_t, kUnpackTimeBuckets> unpack_time{};
+  };
+
 public:
   virtual ~ICache() = default;
 
   // Возвращает книгу с заданным названием. Если её в данный момент нет
   // в кэше, то предварительно считывает её и добавляет в кэш. Следит за тем,
   // чтобы общий объём считанных книг не превосходил указанного в параметре
-  // max_memory. При необходимости удаляет из кэша книги, к которым дольше всего
-  // не обращались. Если размер самой книги уже больше max_memory, то оставляет
-  // кэш пустым.
+  // max_memory. При необходимости удаляет из кэша книги в порядке, заданном
+  // параметром policy. Если размер самой книги уже больше max_memory, то
+  // оставляет кэш пустым.
   virtual BookPtr GetBook(const std::string& book_name) = 0;
+
+  // Возвращает книгу, не дожидаясь распаковки: если книги нет в кэше, она
+  // распаковывается в отдельном потоке и добавляется в кэш так же, как
+  // в GetBook. Одновременные запросы одной и той же книги, в том числе через
+  // GetBook, дожидаются одной общей распаковки
+  virtual std::shared_future<BookPtr> GetBookAsync(
+      const std::string& book_name) = 0;
+
+  // Начинает распаковку тех книг, которых нет в кэше, и сразу возвращает
+  // управление
+  virtual void Prefetch(const std::vector<std::string>& book_names) = 0;
+
+  // Возвращает снимок статистики, не блокируя другие запросы
+  virtual Stats GetStats() const = 0;
 };
 
 // Создаёт объект кэша для заданного распаковщика и заданных настроек
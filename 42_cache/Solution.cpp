@@ -1,60 +1,555 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <future>
 #include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <vector>
 
 #include "Common.h"
 
 using namespace std;
 
-class LruCache : public ICache {
+// Decides which book a shard drops first. A policy owns the order of the
+// resident books, the shard keeps the byte budget and asks for victims
+// until the new book fits.
+class EvictionPolicy {
  public:
-  LruCache(shared_ptr<IBooksUnpacker> books_unpacker, const Settings& settings)
-      : unpacker(books_unpacker), settings(settings) {
-    used_memory = 0;
+  using BookPtr = ICache::BookPtr;
+
+  virtual ~EvictionPolicy() = default;
+
+  // Returns the resident book and records the request, nullptr on a miss
+  virtual BookPtr Find(const string& name) = 0;
+  virtual void Insert(BookPtr book) = 0;
+  // Same as Find, but leaves the order and the request counts as they are
+  virtual bool Contains(const string& name) const = 0;
+  // Removes and returns the book to drop, the policy must not be empty
+  virtual BookPtr Evict() = 0;
+  virtual void Clear() = 0;
+};
+
+class LruPolicy : public EvictionPolicy {
+ public:
+  BookPtr Find(const string& name) override {
+    auto it = book_by_name.find(name);
+    if (it == book_by_name.end()) {
+      return nullptr;
+    }
+    ordered_by_request.splice(ordered_by_request.end(), ordered_by_request,
+                              it->second);
+    return *it->second;
+  }
+
+  bool Contains(const string& name) const override {
+    return book_by_name.count(name) > 0;
+  }
+
+  void Insert(BookPtr book) override {
+    const string& name = book->GetName();
+    book_by_name[name] =
+        ordered_by_request.insert(ordered_by_request.end(), move(book));
+  }
+
+  BookPtr Evict() override {
+    auto book = move(ordered_by_request.front());
+    ordered_by_request.pop_front();
+    book_by_name.erase(book->GetName());
+    return book;
+  }
+
+  void Clear() override {
+    ordered_by_request.clear();
+    book_by_name.clear();
+  }
+
+ private:
+  // Least recently requested first, the map points into the list so that
+  // a hit is moved to the back in O(1)
+  list<BookPtr> ordered_by_request;
+  unordered_map<string, list<BookPtr>::iterator> book_by_name;
+};
+
+class LfuPolicy : public EvictionPolicy {
+ public:
+  BookPtr Find(const string& name) override {
+    auto it = rank_by_name.find(name);
+    if (it == rank_by_name.end()) {
+      return nullptr;
+    }
+    auto node = book_by_rank.extract(it->second);
+    node.key() = {it->second.requests + 1, ++clock};
+    it->second = node.key();
+    return book_by_rank.insert(move(node)).position->second;
+  }
+
+  bool Contains(const string& name) const override {
+    return rank_by_name.count(name) > 0;
+  }
+
+  void Insert(BookPtr book) override {
+    Rank rank{1, ++clock};
+    rank_by_name[book->GetName()] = rank;
+    book_by_rank.emplace(rank, move(book));
+  }
+
+  BookPtr Evict() override {
+    auto book = move(book_by_rank.begin()->second);
+    book_by_rank.erase(book_by_rank.begin());
+    rank_by_name.erase(book->GetName());
+    return book;
+  }
+
+  void Clear() override {
+    book_by_rank.clear();
+    rank_by_name.clear();
+  }
+
+ private:
+  struct Rank {
+    uint64_t requests;
+    uint64_t last_request;
+
+    bool operator<(const Rank& other) const {
+      return tie(requests, last_request) <
+             tie(other.requests, other.last_request);
+    }
+  };
+
+  uint64_t clock = 0;
+  map<Rank, BookPtr> book_by_rank;
+  unordered_map<string, Rank> rank_by_name;
+};
+
+// Simplified 2Q by Johnson and Shasha with byte budgets. New books enter a
+// FIFO holding about a quarter of the budget. Names pushed out of it are
+// remembered, and a book requested again while remembered goes to the main
+// LRU queue. A scan of books requested once only cycles through the FIFO.
+class TwoQueuePolicy : public EvictionPolicy {
+ public:
+  explicit TwoQueuePolicy(size_t max_memory)
+      : max_new_memory(max_memory / 4), max_ghost_memory(max_memory / 2) {}
+
+  BookPtr Find(const string& name) override {
+    auto it = entries.find(name);
+    if (it == entries.end()) {
+      return nullptr;
+    }
+    auto [pos, hot] = it->second;
+    if (hot) {
+      hot_books.splice(hot_books.end(), hot_books, pos);
+    }
+    return *pos;
+  }
+
+  bool Contains(const string& name) const override {
+    return entries.count(name) > 0;
+  }
+
+  void Insert(BookPtr book) override {
+    const string& name = book->GetName();
+    if (auto it = ghost_by_name.find(name); it != ghost_by_name.end()) {
+      ghost_memory -= it->second->second;
+      ghosts.erase(it->second);
+      ghost_by_name.erase(it);
+      entries[name] = {hot_books.insert(hot_books.end(), move(book)), true};
+    } else {
+      new_memory += book->GetContent().size();
+      entries[name] = {new_books.insert(new_books.end(), move(book)), false};
+    }
+  }
+
+  BookPtr Evict() override {
+    BookPtr book;
+    if (!new_books.empty() &&
+        (new_memory > max_new_memory || hot_books.empty())) {
+      book = move(new_books.front());
+      new_books.pop_front();
+      size_t size = book->GetContent().size();
+      new_memory -= size;
+      Remember(book->GetName(), size);
+    } else {
+      book = move(hot_books.front());
+      hot_books.pop_front();
+    }
+    entries.erase(book->GetName());
+    return book;
+  }
+
+  void Clear() override {
+    new_books.clear();
+    hot_books.clear();
+    entries.clear();
+    ghosts.clear();
+    ghost_by_name.clear();
+    new_memory = ghost_memory = 0;
+  }
+
+ private:
+  struct Entry {
+    list<BookPtr>::iterator pos;
+    bool hot = false;
+  };
+
+  // Ghosts are weighed by the size of the book they stand for
+  void Remember(const string& name, size_t size) {
+    ghost_by_name[name] = ghosts.insert(ghosts.end(), {name, size});
+    ghost_memory += size;
+    while (ghost_memory > max_ghost_memory) {
+      ghost_memory -= ghosts.front().second;
+      ghost_by_name.erase(ghosts.front().first);
+      ghosts.pop_front();
+    }
+  }
+
+  const size_t max_new_memory;
+  const size_t max_ghost_memory;
+
+  list<BookPtr> new_books;
+  list<BookPtr> hot_books;
+  unordered_map<string, Entry> entries;
+  size_t new_memory = 0;
+
+  list<pair<string, size_t>> ghosts;
+  unordered_map<string, list<pair<string, size_t>>::iterator> ghost_by_name;
+  size_t ghost_memory = 0;
+};
+
+unique_ptr<EvictionPolicy> MakePolicy(ICache::Settings::Policy policy,
+                                      size_t max_memory) {
+  switch (policy) {
+    case ICache::Settings::Policy::Lfu:
+      return make_unique<LfuPolicy>();
+    case ICache::Settings::Policy::TwoQueue:
+      return make_unique<TwoQueuePolicy>(max_memory);
+    case ICache::Settings::Policy::Lru:
+      break;
+  }
+  return make_unique<LruPolicy>();
+}
+
+// Counters of one shard. Most of them change under the shard mutex anyway,
+// relaxed atomics let GetStats read them without locking and let unpack
+// times be counted outside the lock.
+struct CacheCounters {
+  atomic<size_t> hits = 0;
+  atomic<size_t> misses = 0;
+  atomic<size_t> coalesced_misses = 0;
+  atomic<size_t> evictions = 0;
+  atomic<size_t> evicted_bytes = 0;
+  atomic<size_t> memory = 0;
+  atomic<size_t> entries = 0;
+  array<atomic<size_t>, ICache::Stats::kUnpackTimeBuckets> unpack_time{};
+
+  static void Add(atomic<size_t>& counter, size_t value = 1) {
+    counter.fetch_add(value, memory_order_relaxed);
+  }
+
+  void AddUnpackTime(chrono::steady_clock::duration elapsed) {
+    auto us = chrono::duration_cast<chrono::microseconds>(elapsed).count();
+    size_t bucket = 0;
+    for (; us > 0 && bucket + 1 < unpack_time.size(); us >>= 1) {
+      ++bucket;
+    }
+    Add(unpack_time[bucket]);
+  }
+
+  void AddTo(ICache::Stats& stats) const {
+    auto get = [](const atomic<size_t>& counter) {
+      return counter.load(memory_order_relaxed);
+    };
+    stats.hits += get(hits);
+    stats.misses += get(misses);
+    stats.coalesced_misses += get(coalesced_misses);
+    stats.evictions += get(evictions);
+    stats.evicted_bytes += get(evicted_bytes);
+    stats.memory += get(memory);
+    stats.entries += get(entries);
+    for (size_t i = 0; i < unpack_time.size(); ++i) {
+      stats.unpack_time[i] += get(unpack_time[i]);
+    }
+  }
+};
+
+// Books are spread over shards by name hash. A shard is guarded by its own
+// mutex and holds at most its slice of max_memory. Books are unpacked with
+// no lock held; a miss on a book that is already being unpacked waits for
+// that unpack instead of starting another one. GetBookAsync and Prefetch
+// queue the same unpack for at most unpack_threads worker threads, which
+// are started as the queue needs them and kept until the cache is gone.
+class ShardedCache : public ICache {
+ public:
+  ShardedCache(shared_ptr<IBooksUnpacker> books_unpacker,
+               const Settings& settings)
+      : unpacker(move(books_unpacker)),
+        shards(max<size_t>(settings.shard_count, 1)),
+        max_memory(settings.max_memory),
+        max_unpack_threads(max<size_t>(settings.unpack_threads, 1)) {
+    for (size_t i = 0; i < shards.size(); ++i) {
+      shards[i].max_memory = max_memory / shards.size() +
+                             (i < max_memory % shards.size() ? 1 : 0);
+      shards[i].policy = MakePolicy(settings.policy, shards[i].max_memory);
+    }
+  }
+
+  // Unpacks already queued are finished before the shards go away
+  ~ShardedCache() override {
+    {
+      lock_guard<mutex> lock(tasks_m);
+      stopping = true;
+    }
+    tasks_cv.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
   }
 
   BookPtr GetBook(const string& book_name) override {
-    lock_guard<mutex> lg(m);
-    if (auto it = book_by_name.find(book_name); it != book_by_name.end()) {
-      ordered_by_request.remove(it->second);
-      ordered_by_request.push_back(it->second);
-      return it->second;
+    promise<BookPtr> unpacked;
+    auto lookup = Lookup(book_name, unpacked);
+    if (lookup.book) {
+      return lookup.book;
     }
+    if (!lookup.owner) {
+      return lookup.pending.get();
+    }
+    return Unpack(book_name, unpacked);
+  }
 
-    auto ptr = BookPtr(unpacker->UnpackBook(book_name));
-    size_t size = ptr->GetContent().size();
+  shared_future<BookPtr> GetBookAsync(const string& book_name) override {
+    promise<BookPtr> unpacked;
+    auto lookup = Lookup(book_name, unpacked);
+    if (lookup.book) {
+      promise<BookPtr> ready;
+      ready.set_value(move(lookup.book));
+      return ready.get_future().share();
+    }
+    if (lookup.owner) {
+      StartUnpack(book_name, move(unpacked));
+    }
+    return lookup.pending;
+  }
+
+  // Books already cached or being unpacked are skipped without counting a
+  // request, so prefetching does not change their eviction order
+  void Prefetch(const vector<string>& book_names) override {
+    for (const auto& book_name : book_names) {
+      promise<BookPtr> unpacked;
+      if (Reserve(book_name, unpacked)) {
+        StartUnpack(book_name, move(unpacked));
+      }
+    }
+  }
+
+  Stats GetStats() const override {
+    Stats stats;
+    for (const auto& shard : shards) {
+      shard.counters.AddTo(stats);
+    }
+    return stats;
+  }
+
+ private:
+  struct Shard {
+    mutex m;
+    unique_ptr<EvictionPolicy> policy;
+    unordered_map<string, shared_future<BookPtr>> loading;
+    size_t used_memory = 0;
+    size_t entries = 0;
+    size_t max_memory = 0;
+    CacheCounters counters;
+
+    void Clear() {
+      policy->Clear();
+      CacheCounters::Add(counters.evictions, entries);
+      CacheCounters::Add(counters.evicted_bytes, used_memory);
+      used_memory = entries = 0;
+      PublishSize();
+    }
+
+    void PublishSize() {
+      counters.memory.store(used_memory, memory_order_relaxed);
+      counters.entries.store(entries, memory_order_relaxed);
+    }
+
+    // Books larger than the whole slice are not kept and empty the shard
+    void Insert(const BookPtr& ptr, size_t size) {
+      if (size > max_memory) {
+        Clear();
+        return;
+      }
 
-    if (size > settings.max_memory) {
-      ordered_by_request.clear();
-      book_by_name.clear();
-      used_memory = 0;
-      return ptr;
+      while (used_memory + size > max_memory) {
+        size_t evicted_size = policy->Evict()->GetContent().size();
+        used_memory -= evicted_size;
+        --entries;
+        CacheCounters::Add(counters.evictions);
+        CacheCounters::Add(counters.evicted_bytes, evicted_size);
+      }
+
+      policy->Insert(ptr);
+      used_memory += size;
+      ++entries;
+      PublishSize();
     }
+  };
+
+  // Either the cached book, or the unpack to wait for. If the caller is the
+  // owner it must fulfil the promise with Unpack
+  struct LookupResult {
+    BookPtr book;
+    shared_future<BookPtr> pending;
+    bool owner = false;
+  };
+
+  Shard& GetShard(const string& book_name) {
+    return shards[hash<string>()(book_name) % shards.size()];
+  }
 
-    while (used_memory + size > settings.max_memory) {
-      auto last_ptr = ordered_by_request.front();
-      ordered_by_request.pop_front();
-      book_by_name.erase(last_ptr->GetName());
-      used_memory -= last_ptr->GetContent().size();
+  LookupResult Lookup(const string& book_name, promise<BookPtr>& unpacked) {
+    auto& shard = GetShard(book_name);
+    lock_guard<mutex> lock(shard.m);
+    if (auto ptr = shard.policy->Find(book_name)) {
+      CacheCounters::Add(shard.counters.hits);
+      return {move(ptr), {}, false};
     }
+    if (auto it = shard.loading.find(book_name); it != shard.loading.end()) {
+      CacheCounters::Add(shard.counters.coalesced_misses);
+      return {nullptr, it->second, false};
+    }
+    CacheCounters::Add(shard.counters.misses);
+    auto pending = unpacked.get_future().share();
+    shard.loading.emplace(book_name, pending);
+    return {nullptr, move(pending), true};
+  }
 
-    book_by_name[book_name] = ptr;
-    ordered_by_request.push_back(ptr);
-    used_memory += size;
+  // The miss branch of Lookup for a book that is neither cached nor being
+  // unpacked. Returns false, touching nothing, for any other book
+  bool Reserve(const string& book_name, promise<BookPtr>& unpacked) {
+    auto& shard = GetShard(book_name);
+    lock_guard<mutex> lock(shard.m);
+    if (shard.policy->Contains(book_name) || shard.loading.count(book_name)) {
+      return false;
+    }
+    CacheCounters::Add(shard.counters.misses);
+    shard.loading.emplace(book_name, unpacked.get_future().share());
+    return true;
+  }
 
+  // Queues Unpack for a worker, starting one if all are busy and there are
+  // fewer than max_unpack_threads. If no worker can be started the book is
+  // released and the error goes both to the waiters and to the caller
+  void StartUnpack(const string& book_name, promise<BookPtr> unpacked) {
+    auto shared_unpacked = make_shared<promise<BookPtr>>(move(unpacked));
+    exception_ptr error;
+    {
+      lock_guard<mutex> lock(tasks_m);
+      tasks.push_back([this, book_name, shared_unpacked] {
+        try {
+          Unpack(book_name, *shared_unpacked);
+        } catch (...) {
+          // Already stored in the future
+        }
+      });
+      try {
+        if (tasks.size() > idle_workers &&
+            workers.size() < max_unpack_threads) {
+          workers.emplace_back([this] { Work(); });
+        }
+      } catch (...) {
+        error = current_exception();
+      }
+      // Without a new worker the running ones take the task later
+      if (!error || !workers.empty()) {
+        tasks_cv.notify_one();
+        return;
+      }
+      tasks.pop_back();
+    }
+    auto& shard = GetShard(book_name);
+    {
+      lock_guard<mutex> shard_lock(shard.m);
+      shard.loading.erase(book_name);
+    }
+    shared_unpacked->set_exception(error);
+    rethrow_exception(error);
+  }
+
+  // Runs queued tasks until the cache is destroyed and the queue is empty
+  void Work() {
+    unique_lock<mutex> lock(tasks_m);
+    while (true) {
+      ++idle_workers;
+      tasks_cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+      --idle_workers;
+      if (tasks.empty()) {
+        return;
+      }
+      auto task = move(tasks.front());
+      tasks.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+  BookPtr Unpack(const string& book_name, promise<BookPtr>& unpacked) {
+    auto& shard = GetShard(book_name);
+    BookPtr ptr;
+    auto start = chrono::steady_clock::now();
+    try {
+      ptr = unpacker->UnpackBook(book_name);
+      shard.counters.AddUnpackTime(chrono::steady_clock::now() - start);
+    } catch (...) {
+      lock_guard<mutex> lock(shard.m);
+      shard.loading.erase(book_name);
+      unpacked.set_exception(current_exception());
+      throw;
+    }
+
+    unique_lock<mutex> lock(shard.m);
+    shard.loading.erase(book_name);
+    size_t size = ptr->GetContent().size();
+    if (size > max_memory) {
+      lock.unlock();
+      for (auto& other : shards) {
+        lock_guard<mutex> other_lock(other.m);
+        other.Clear();
+      }
+    } else {
+      shard.Insert(ptr, size);
+      lock.unlock();
+    }
+
+    unpacked.set_value(ptr);
     return ptr;
   }
 
- private:
   shared_ptr<IBooksUnpacker> unpacker;
-  Settings settings;
-  list<BookPtr> ordered_by_request;
-  unordered_map<string, BookPtr> book_by_name;
-  size_t used_memory;
-  mutex m;
+  vector<Shard> shards;
+  size_t max_memory;
+
+  // Unpacks queued by GetBookAsync and Prefetch, and the workers running
+  // them. idle_workers counts the workers waiting for a task
+  const size_t max_unpack_threads;
+  mutex tasks_m;
+  condition_variable tasks_cv;
+  deque<function<void()>> tasks;
+  size_t idle_workers = 0;
+  bool stopping = false;
+  vector<thread> workers;
 };
 
 unique_ptr<ICache> MakeCache(shared_ptr<IBooksUnpacker> books_unpacker,
                              const ICache::Settings& settings) {
-  return make_unique<LruCache>(move(books_unpacker), settings);
+  return make_unique<ShardedCache>(move(books_unpacker), settings);
 }
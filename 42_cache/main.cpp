@@ -1,11 +1,16 @@
 #include "Common.h"
+#include "../profile.h"
 #include "../test_runner.h"
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <future>
+#include <limits>
 #include <numeric>
 #include <random>
 #include <sstream>
+#include <thread>
 
 using namespace std;
 
@@ -78,6 +83,43 @@ private:
   atomic<int> unpacked_books_count_ = 0;
 };
 
+// Распаковщик, который держит каждый вызов UnpackBook, пока одновременно
+// не начнётся concurrency вызовов или не истечёт timeout. Так можно
+// проверить, что кэш не распаковывает книги под общим мьютексом
+class SlowUnpacker : public BooksUnpacker {
+public:
+  explicit SlowUnpacker(int concurrency,
+                        chrono::milliseconds timeout = chrono::seconds(1))
+    : concurrency_(concurrency), timeout_(timeout) {}
+
+  unique_ptr<IBook> UnpackBook(const string& book_name) override {
+    {
+      unique_lock<mutex> lock(m_);
+      ++running_;
+      max_running_ = max(max_running_, running_);
+      cv_.notify_all();
+      cv_.wait_for(lock, timeout_, [this] { return running_ >= concurrency_; });
+    }
+    auto book = BooksUnpacker::UnpackBook(book_name);
+    lock_guard<mutex> lock(m_);
+    --running_;
+    return book;
+  }
+
+  int GetMaxRunning() const {
+    lock_guard<mutex> lock(m_);
+    return max_running_;
+  }
+
+private:
+  const int concurrency_;
+  const chrono::milliseconds timeout_;
+  mutable mutex m_;
+  condition_variable cv_;
+  int running_ = 0;
+  int max_running_ = 0;
+};
+
 struct Library {
   vector<string> book_names;
   unordered_map<string, unique_ptr<IBook>> content;
@@ -182,6 +224,403 @@ void TestAsync(const Library& lib) {
 }
 
 
+void TestShardedMaxMemory(const Library& lib) {
+  auto unpacker = make_shared<BooksUnpacker>();
+  ICache::Settings settings;
+  settings.max_memory = lib.size_in_bytes / 2;
+  settings.shard_count = 4;
+  auto cache = MakeCache(unpacker, settings);
+
+  for (int i = 0; i < 3; ++i) {
+    for (const auto& book_name : lib.book_names) {
+      cache->GetBook(book_name);
+      ASSERT(unpacker->GetMemoryUsedByBooks() <= settings.max_memory);
+    }
+  }
+  ASSERT(unpacker->GetMemoryUsedByBooks() > 0);
+}
+
+
+void TestUnpackOutsideLock(const Library& lib) {
+  auto unpacker = make_shared<SlowUnpacker>(2);
+  ICache::Settings settings;
+  settings.max_memory = lib.size_in_bytes;
+  auto cache = MakeCache(unpacker, settings);
+
+  auto first = async(launch::async,
+                     [&] { return cache->GetBook(lib.book_names[0]); });
+  auto second = async(launch::async,
+                      [&] { return cache->GetBook(lib.book_names[1]); });
+  ASSERT_EQUAL(first.get()->GetName(), lib.book_names[0]);
+  ASSERT_EQUAL(second.get()->GetName(), lib.book_names[1]);
+  ASSERT_EQUAL(unpacker->GetMaxRunning(), 2);
+}
+
+
+void TestCoalescedMisses(const Library& lib) {
+  // Первый вызов ждёт остальные потоки, которые тем временем тоже
+  // промахиваются по той же книге
+  auto unpacker = make_shared<SlowUnpacker>(2, chrono::milliseconds(200));
+  ICache::Settings settings;
+  settings.max_memory = lib.size_in_bytes;
+  settings.shard_count = 3;
+  auto cache = MakeCache(unpacker, settings);
+
+  vector<future<ICache::BookPtr>> tasks;
+  for (int i = 0; i < 8; ++i) {
+    tasks.push_back(async(launch::async,
+                          [&] { return cache->GetBook(lib.book_names[2]); }));
+  }
+  auto book = tasks.front().get();
+  for (auto& task : tasks) {
+    if (task.valid()) {
+      ASSERT_EQUAL(task.get(), book);
+    }
+  }
+  ASSERT_EQUAL(unpacker->GetUnpackedBooksCount(), 1);
+}
+
+
+void TestGetBookAsync(const Library& lib) {
+  auto unpacker = make_shared<SlowUnpacker>(2, chrono::milliseconds(200));
+  ICache::Settings settings;
+  settings.max_memory = lib.size_in_bytes;
+  settings.shard_count = 2;
+  auto cache = MakeCache(unpacker, settings);
+
+  auto first = cache->GetBookAsync(lib.book_names[0]);
+  auto second = cache->GetBookAsync(lib.book_names[0]);
+  auto other = cache->GetBookAsync(lib.book_names[1]);
+  ASSERT_EQUAL(cache->GetBook(lib.book_names[0]), first.get());
+  ASSERT_EQUAL(second.get(), first.get());
+  ASSERT_EQUAL(other.get()->GetName(), lib.book_names[1]);
+  ASSERT_EQUAL(unpacker->GetUnpackedBooksCount(), 2);
+  ASSERT_EQUAL(unpacker->GetMaxRunning(), 2);
+
+  // Книга уже в кэше
+  ASSERT_EQUAL(cache->GetBookAsync(lib.book_names[1]).get(), other.get());
+  ASSERT_EQUAL(unpacker->GetUnpackedBooksCount(), 2);
+}
+
+
+void TestPrefetch(const Library& lib) {
+  auto unpacker = make_shared<BooksUnpacker>();
+  ICache::Settings settings;
+  // Каждой части хватает памяти на всю библиотеку
+  settings.max_memory = 3 * lib.size_in_bytes;
+  settings.shard_count = 3;
+  auto cache = MakeCache(unpacker, settings);
+
+  cache->Prefetch(lib.book_names);
+  cache->Prefetch(lib.book_names);
+  for (const auto& book_name : lib.book_names) {
+    ASSERT_EQUAL(cache->GetBook(book_name)->GetName(), book_name);
+  }
+  ASSERT_EQUAL(unpacker->GetUnpackedBooksCount(),
+               static_cast<int>(lib.book_names.size()));
+}
+
+
+void TestPrefetchCached(const Library& lib) {
+  // Предзагрузка книги из кэша не считается запросом: её место в очереди
+  // на вытеснение и счётчики не меняются
+  auto unpacker = make_shared<BooksUnpacker>();
+  ICache::Settings settings;
+  settings.max_memory = lib.content.at(lib.book_names[0])->GetContent().size() +
+                        lib.content.at(lib.book_names[1])->GetContent().size();
+  settings.shard_count = 1;
+  auto cache = MakeCache(unpacker, settings);
+
+  cache->GetBook(lib.book_names[0]);
+  cache->GetBook(lib.book_names[1]);
+  cache->Prefetch({lib.book_names[0]});
+  auto stats = cache->GetStats();
+  ASSERT_EQUAL(stats.hits, size_t(0));
+  ASSERT_EQUAL(stats.misses, size_t(2));
+
+  // Вытесняется первая книга, а не вторая
+  cache->GetBook(lib.book_names[2]);
+  cache->GetBook(lib.book_names[1]);
+  ASSERT_EQUAL(unpacker->GetUnpackedBooksCount(), 3);
+  ASSERT_EQUAL(cache->GetStats().hits, size_t(1));
+
+  // Книга, которая уже распаковывается, тоже пропускается
+  auto slow_unpacker = make_shared<SlowUnpacker>(2, chrono::milliseconds(100));
+  auto slow_cache = MakeCache(slow_unpacker, settings);
+  auto pending = slow_cache->GetBookAsync(lib.book_names[0]);
+  slow_cache->Prefetch({lib.book_names[0]});
+  pending.get();
+  stats = slow_cache->GetStats();
+  ASSERT_EQUAL(stats.misses, size_t(1));
+  ASSERT_EQUAL(stats.coalesced_misses + stats.hits, size_t(0));
+  ASSERT_EQUAL(slow_unpacker->GetUnpackedBooksCount(), 1);
+}
+
+
+void TestPrefetchOnDestruction(const Library& lib) {
+  // Кэш, уничтоженный во время распаковки, должен её дождаться
+  auto unpacker = make_shared<SlowUnpacker>(3, chrono::milliseconds(50));
+  ICache::Settings settings;
+  settings.max_memory = lib.size_in_bytes;
+  auto cache = MakeCache(unpacker, settings);
+  cache->Prefetch(lib.book_names);
+  cache.reset();
+  ASSERT_EQUAL(unpacker->GetUnpackedBooksCount(),
+               static_cast<int>(lib.book_names.size()));
+  ASSERT_EQUAL(unpacker->GetMemoryUsedByBooks(), size_t(0));
+}
+
+
+void TestPrefetchUnpackThreads(const Library& lib) {
+  // Распаковщик ждёт, пока одновременно не начнутся все распаковки, а кэш
+  // запускает не больше unpack_threads из них
+  auto unpacker = make_shared<SlowUnpacker>(
+      static_cast<int>(lib.book_names.size()), chrono::milliseconds(20));
+  ICache::Settings settings;
+  settings.max_memory = lib.size_in_bytes;
+  settings.unpack_threads = 2;
+  auto cache = MakeCache(unpacker, settings);
+
+  cache->Prefetch(lib.book_names);
+  auto pending = cache->GetBookAsync(lib.book_names[0]);
+  for (const auto& book_name : lib.book_names) {
+    ASSERT_EQUAL(cache->GetBookAsync(book_name).get()->GetName(), book_name);
+  }
+  ASSERT_EQUAL(pending.get()->GetName(), lib.book_names[0]);
+  ASSERT_EQUAL(unpacker->GetUnpackedBooksCount(),
+               static_cast<int>(lib.book_names.size()));
+  ASSERT_EQUAL(unpacker->GetMaxRunning(), 2);
+}
+
+
+size_t SumUnpackTime(const ICache::Stats& stats) {
+  return accumulate(stats.unpack_time.begin(), stats.unpack_time.end(),
+                    size_t(0));
+}
+
+
+void TestStats(const Library& lib) {
+  const int tasks_count = 8;
+  const int trials_count = 10000;
+
+  auto unpacker = make_shared<BooksUnpacker>();
+  ICache::Settings settings;
+  settings.max_memory = lib.size_in_bytes / 2;
+  settings.shard_count = 4;
+  auto cache = MakeCache(unpacker, settings);
+
+  vector<future<void>> tasks;
+  for (int task_num = 0; task_num < tasks_count; ++task_num) {
+    tasks.push_back(async(launch::async, [&cache, &lib, task_num] {
+      default_random_engine gen(task_num);
+      uniform_int_distribution<size_t> dis(0, lib.book_names.size() - 1);
+      for (int i = 0; i < trials_count; ++i) {
+        cache->GetBook(lib.book_names[dis(gen)]);
+        // Снимок можно брать одновременно с запросами
+        if (i % 1000 == 0) {
+          cache->GetStats();
+        }
+      }
+    }));
+  }
+  for (auto& task : tasks) {
+    task.get();
+  }
+
+  auto stats = cache->GetStats();
+  ASSERT_EQUAL(stats.hits + stats.misses + stats.coalesced_misses,
+               size_t(tasks_count * trials_count));
+  ASSERT_EQUAL(stats.misses, size_t(unpacker->GetUnpackedBooksCount()));
+  ASSERT_EQUAL(SumUnpackTime(stats), stats.misses);
+  ASSERT_EQUAL(stats.evictions + stats.entries, stats.misses);
+  ASSERT_EQUAL(stats.memory, unpacker->GetMemoryUsedByBooks());
+  ASSERT(stats.memory <= settings.max_memory);
+  ASSERT(stats.evicted_bytes > 0);
+}
+
+
+void TestStatsCoalescedMisses(const Library& lib) {
+  auto unpacker = make_shared<SlowUnpacker>(2, chrono::milliseconds(100));
+  ICache::Settings settings;
+  settings.max_memory = lib.size_in_bytes;
+  auto cache = MakeCache(unpacker, settings);
+
+  vector<future<ICache::BookPtr>> tasks;
+  for (int i = 0; i < 4; ++i) {
+    tasks.push_back(async(launch::async,
+                          [&] { return cache->GetBook(lib.book_names[0]); }));
+  }
+  for (auto& task : tasks) {
+    task.get();
+  }
+
+  auto stats = cache->GetStats();
+  ASSERT_EQUAL(stats.misses, size_t(1));
+  ASSERT_EQUAL(stats.hits + stats.coalesced_misses, size_t(3));
+  ASSERT_EQUAL(stats.entries, size_t(1));
+  ASSERT_EQUAL(stats.evictions, size_t(0));
+  // Распаковка длилась не меньше 100 мс, то есть больше 2^16 мкс
+  ASSERT_EQUAL(accumulate(stats.unpack_time.begin() + 17,
+                          stats.unpack_time.end(), size_t(0)),
+               size_t(1));
+
+  // Книга больше всего кэша вытесняет остальные
+  ICache::Settings small_settings;
+  small_settings.max_memory = 1;
+  auto small_cache = MakeCache(unpacker, small_settings);
+  small_cache->GetBook(lib.book_names[0]);
+  stats = small_cache->GetStats();
+  ASSERT_EQUAL(stats.entries, size_t(0));
+  ASSERT_EQUAL(stats.memory, size_t(0));
+}
+
+
+using Policy = ICache::Settings::Policy;
+
+const vector<pair<Policy, string>> policies = {
+  {Policy::Lru, "LRU"},
+  {Policy::Lfu, "LFU"},
+  {Policy::TwoQueue, "2Q"},
+};
+
+// Прогоняет запросы через новый кэш и возвращает число распаковок
+int ReplayTrace(const vector<string>& trace, Policy policy, size_t max_memory) {
+  auto unpacker = make_shared<BooksUnpacker>();
+  ICache::Settings settings;
+  settings.max_memory = max_memory;
+  settings.policy = policy;
+  auto cache = MakeCache(unpacker, settings);
+
+  for (const auto& book_name : trace) {
+    cache->GetBook(book_name);
+    ASSERT(unpacker->GetMemoryUsedByBooks() <= max_memory);
+  }
+  return unpacker->GetUnpackedBooksCount();
+}
+
+// Несколько часто запрашиваемых книг, каждая дважды за раунд, вперемешку
+// с просмотром книг, каждая из которых запрашивается один раз
+vector<string> MakeScanTrace(int hot_count, int rounds, int scan_length) {
+  vector<string> trace;
+  int scanned = 0;
+  for (int round = 0; round < rounds; ++round) {
+    for (int repeat = 0; repeat < 2; ++repeat) {
+      for (int i = 0; i < hot_count; ++i) {
+        trace.push_back("Hot #" + to_string(i));
+      }
+    }
+    for (int i = 0; i < scan_length; ++i) {
+      trace.push_back("Scan #" + to_string(scanned++));
+    }
+  }
+  return trace;
+}
+
+
+void TestPolicyMaxMemory(const Library& lib) {
+  vector<string> trace;
+  for (int i = 0; i < 5; ++i) {
+    trace.insert(trace.end(), lib.book_names.begin(), lib.book_names.end());
+    trace.insert(trace.end(), lib.book_names.begin(),
+                 lib.book_names.begin() + i);
+  }
+  for (const auto& [policy, name] : policies) {
+    ReplayTrace(trace, policy, lib.size_in_bytes / 2);
+  }
+}
+
+
+void TestScanResistance() {
+  const auto trace = MakeScanTrace(4, 100, 10);
+  BooksUnpacker unpacker;
+  const size_t max_memory =
+      12 * unpacker.UnpackBook("Scan #99")->GetContent().size();
+
+  const int lru_unpacks = ReplayTrace(trace, Policy::Lru, max_memory);
+  // Просмотр каждый раз вытесняет все часто запрашиваемые книги
+  ASSERT_EQUAL(lru_unpacks, 100 * (4 + 10));
+  ASSERT(ReplayTrace(trace, Policy::Lfu, max_memory) <= 4 + 100 * 10);
+  // Книги попадают в основную очередь со второго раунда
+  ASSERT(ReplayTrace(trace, Policy::TwoQueue, max_memory) <= 2 * 4 + 100 * 10);
+}
+
+
+// Частота обращений к книгам распределена неравномерно, время от времени
+// все книги библиотеки просматриваются подряд
+void BenchmarkEvictionPolicies() {
+  const int books_count = 10'000;
+  const int requests_count = 500'000;
+  const int scan_period = 20'000;
+
+  default_random_engine gen;
+  uniform_real_distribution<double> dis;
+  vector<string> trace;
+  trace.reserve(requests_count + requests_count / scan_period * books_count);
+  for (int i = 0; i < requests_count; ++i) {
+    if (i % scan_period == 0) {
+      for (int j = 0; j < books_count; ++j) {
+        trace.push_back("Book #" + to_string(j));
+      }
+    }
+    double u = dis(gen);
+    trace.push_back("Book #" + to_string(int(books_count * u * u * u)));
+  }
+
+  BooksUnpacker unpacker;
+  const size_t max_memory =
+      books_count / 10 * unpacker.UnpackBook("Book #0")->GetContent().size();
+
+  for (const auto& [policy, name] : policies) {
+    auto unpacker = make_shared<BooksUnpacker>();
+    ICache::Settings settings;
+    settings.max_memory = max_memory;
+    settings.policy = policy;
+    auto cache = MakeCache(unpacker, settings);
+
+    auto start = chrono::steady_clock::now();
+    for (const auto& book_name : trace) {
+      cache->GetBook(book_name);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    ASSERT(unpacker->GetMemoryUsedByBooks() <= max_memory);
+
+    double hits = trace.size() - unpacker->GetUnpackedBooksCount();
+    cerr << name << ": hit ratio " << hits / trace.size() << ", "
+         << trace.size() / elapsed.count() << " ops/sec\n";
+  }
+}
+
+
+// Время попадания в кэш не должно зависеть от числа книг в нём
+void BenchmarkHitLatency() {
+  const int hits_count = 1'000'000;
+  for (int books_count : {10, 1'000, 100'000, 1'000'000}) {
+    auto unpacker = make_shared<BooksUnpacker>();
+    ICache::Settings settings;
+    settings.max_memory = numeric_limits<size_t>::max();
+    auto cache = MakeCache(unpacker, settings);
+
+    vector<string> book_names;
+    for (int i = 0; i < books_count; ++i) {
+      book_names.push_back("Book #" + to_string(i));
+      cache->GetBook(book_names.back());
+    }
+
+    default_random_engine gen;
+    uniform_int_distribution<size_t> dis(0, books_count - 1);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < hits_count; ++i) {
+      cache->GetBook(book_names[dis(gen)]);
+    }
+    chrono::duration<double, nano> elapsed =
+        chrono::steady_clock::now() - start;
+    ASSERT_EQUAL(unpacker->GetUnpackedBooksCount(), books_count);
+    cerr << books_count << " books: " << elapsed.count() / hits_count
+         << " ns per hit\n";
+  }
+}
+
+
 int main() {
   BooksUnpacker unpacker;
   const Library lib(
@@ -210,6 +649,21 @@ int main() {
   RUN_CACHE_TEST(tr, TestCaching);
   RUN_CACHE_TEST(tr, TestSmallCache);
   RUN_CACHE_TEST(tr, TestAsync);
+  RUN_CACHE_TEST(tr, TestShardedMaxMemory);
+  RUN_CACHE_TEST(tr, TestUnpackOutsideLock);
+  RUN_CACHE_TEST(tr, TestCoalescedMisses);
+  RUN_CACHE_TEST(tr, TestGetBookAsync);
+  RUN_CACHE_TEST(tr, TestPrefetch);
+  RUN_CACHE_TEST(tr, TestPrefetchCached);
+  RUN_CACHE_TEST(tr, TestPrefetchOnDestruction);
+  RUN_CACHE_TEST(tr, TestPrefetchUnpackThreads);
+  RUN_CACHE_TEST(tr, TestStats);
+  RUN_CACHE_TEST(tr, TestStatsCoalescedMisses);
+  RUN_CACHE_TEST(tr, TestPolicyMaxMemory);
+  RUN_TEST(tr, TestScanResistance);
+
+  RUN_TEST(tr, BenchmarkHitLatency);
+  RUN_TEST(tr, BenchmarkEvictionPolicies);
 
 #undef RUN_CACHE_TEST
   return 0;
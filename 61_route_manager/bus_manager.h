@@ -4,23 +4,38 @@
 #include "json.h"
 #include "stop_manager.h"
 
+#include <algorithm>
 #include <functional>
 #include <iomanip>
-#include <set>
-#include <unordered_map>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <vector>
 
 class BusManager {
+  friend class RouteSnapshot;
+
  private:
+  using StopId = StopManager::StopId;
   struct Bus {
     bool is_route_looped;
-    std::vector<std::string> stops;
+    std::vector<StopId> stops;
   };
-  using Buses = std::unordered_map<std::string, Bus>;
-  Buses buses_;
+  struct Stats {
+    int stops_n;
+    int stops_n_unique;
+    int road_len;
+    double geo_len;
+  };
+  Interner names_;
+  std::vector<Bus> buses_;
+  // Indexed by bus id, empty entries are recomputed on demand
+  std::vector<std::optional<Stats>> stats_;
   StopManager& sm_;
 
-  void Load(const std::string& bus_id, bool looped,
-            std::vector<std::string>& stops);
+  void Load(std::string_view bus_id, bool looped, std::vector<StopId>& stops);
+  void SyncWithStops();
+  Stats Compute(const Bus& bus) const;
 
  public:
   struct ProcessResult {
@@ -34,26 +49,34 @@ class BusManager {
   BusManager(StopManager& sm) : sm_(sm) {}
   void Load(std::string_view input);
   void Load(const Json::Node& input);
+  void Load(const Json::ArenaNode& input);
+  // Computes stats of every bus so that Process is a table lookup. Buses
+  // with a missing road distance are left to throw when requested.
+  void Freeze();
   ProcessResult Process(const std::string& bus_id);
+  // Same as Process but only reads the stats table, so it is safe to call
+  // from several threads. Valid after Freeze until the next Load.
+  ProcessResult ProcessFrozen(const std::string& bus_id) const;
 };
 
-void BusManager::Load(const std::string& bus_id, bool looped,
-                      std::vector<std::string>& stops) {
-  auto bus_it = buses_.find(bus_id);
-  if (bus_it != buses_.end()) {
+void BusManager::Load(std::string_view bus_id, bool looped,
+                      std::vector<StopId>& stops) {
+  if (names_.Find(bus_id)) {
     std::stringstream error;
     error << "Redefinition: Bus id = " << bus_id << " is already defined";
     throw std::invalid_argument(error.str());
   }
 
-  auto& bus = buses_[bus_id];
+  auto id = names_.Intern(bus_id);
+  auto& bus = buses_.emplace_back();
   bus.is_route_looped = looped;
   bus.stops = std::move(stops);
-  for (auto& stop : bus.stops) sm_.Update(bus_id, stop);
+  stats_.emplace_back();
+  for (auto stop : bus.stops) sm_.Update(names_.GetName(id), stop);
 }
 
 void BusManager::Load(std::string_view input) {
-  auto bus_id = std::string(RemoveSpaces(ReadToken(input, ":")));
+  auto bus_id = RemoveSpaces(ReadToken(input, ":"));
   std::pair<int, int> delim_counter;
   for (auto& it : input) {
     if (it == '-')
@@ -63,28 +86,39 @@ void BusManager::Load(std::string_view input) {
   }
 
   std::string_view delim = delim_counter.first == 0 ? ">" : "-";
-  std::vector<std::string> stops;
-  stops.reserve(delim_counter.first + delim_counter.second);
+  std::vector<StopId> stops;
+  stops.reserve(delim_counter.first + delim_counter.second + 1);
   while (!input.empty())
-    stops.push_back(std::string(RemoveSpaces(ReadToken(input, delim))));
+    stops.push_back(sm_.Intern(RemoveSpaces(ReadToken(input, delim))));
 
   Load(bus_id, delim_counter.first == 0, stops);
 }
 
 void BusManager::Load(const Json::Node& input) {
   auto& input_map = input.AsMap();
-  auto bus_id = input_map.at("name").AsString();
+  auto& bus_id = input_map.at("name").AsString();
 
-  std::vector<std::string> stops;
+  std::vector<StopId> stops;
   if (input_map.find("stops") != input_map.end()) {
     auto& stops_array = input_map.at("stops").AsArray();
     stops.reserve(stops_array.size());
-    for (auto& stop : stops_array) stops.push_back(stop.AsString());
+    for (auto& stop : stops_array) stops.push_back(sm_.Intern(stop.AsString()));
   }
   bool is_looped = input_map.at("is_roundtrip").AsBoolean();
   Load(bus_id, is_looped, stops);
 }
 
+void BusManager::Load(const Json::ArenaNode& input) {
+  std::vector<StopId> stops;
+  if (auto stops_array = input.Find("stops")) {
+    stops.reserve(stops_array->AsArray().size());
+    for (auto& stop : stops_array->AsArray())
+      stops.push_back(sm_.Intern(stop.AsString()));
+  }
+  Load(input.At("name").AsString(), input.At("is_roundtrip").AsBoolean(),
+       stops);
+}
+
 template <class Output, class Iterator, class Func>
 Output AccumulateWithNext(Iterator begin, Iterator end, Func f) {
   Output result = Output();
@@ -93,29 +127,66 @@ Output AccumulateWithNext(Iterator begin, Iterator end, Func f) {
   return result;
 }
 
+void BusManager::SyncWithStops() {
+  sm_.Freeze();
+  for (auto stop : sm_.TakeRedefined())
+    for (auto bus_name : sm_.GetBuses(stop))
+      stats_[*names_.Find(bus_name)].reset();
+}
+
+void BusManager::Freeze() {
+  SyncWithStops();
+  for (size_t id = 0; id < buses_.size(); ++id) {
+    if (stats_[id]) continue;
+    try {
+      stats_[id] = Compute(buses_[id]);
+    } catch (std::out_of_range&) {
+      // Stays empty, a request for the bus computes it again and throws
+    }
+  }
+}
+
 BusManager::ProcessResult BusManager::Process(const std::string& bus_id) {
-  auto bus_it = buses_.find(bus_id);
-  if (bus_it == buses_.end()) return {.success = false, .bus_id = bus_id};
+  auto id = names_.Find(bus_id);
+  if (!id) return {false, bus_id, 0, 0, 0, 0};
+
+  SyncWithStops();
+  auto& stats = stats_[*id];
+  if (!stats) stats = Compute(buses_[*id]);
+  return {true, bus_id, stats->stops_n, stats->stops_n_unique, stats->road_len,
+          stats->geo_len};
+}
+
+BusManager::ProcessResult BusManager::ProcessFrozen(
+    const std::string& bus_id) const {
+  auto id = names_.Find(bus_id);
+  if (!id) return {false, bus_id, 0, 0, 0, 0};
+
+  // Empty only if a road distance is missing, then Compute throws
+  auto stats = stats_[*id] ? *stats_[*id] : Compute(buses_[*id]);
+  return {true, bus_id, stats.stops_n, stats.stops_n_unique, stats.road_len,
+          stats.geo_len};
+}
 
-  auto& bus = buses_[bus_id];
-  bool is_looped = buses_[bus_id].is_route_looped;
+BusManager::Stats BusManager::Compute(const Bus& bus) const {
+  bool is_looped = bus.is_route_looped;
   int n = is_looped ? bus.stops.size() : 2 * bus.stops.size() - 1;
-  int n_unique =
-      std::set<std::string>(bus.stops.begin(), bus.stops.end()).size();
 
-  double len_geo = AccumulateWithNext<double>(
-      bus.stops.begin(), bus.stops.end(), [&](auto& x, auto& y) {
-        return CalculateGeoLength(sm_.Get().at(x).pos, sm_.Get().at(y).pos);
-      });
+  auto unique_stops = bus.stops;
+  std::sort(unique_stops.begin(), unique_stops.end());
+  int n_unique = std::unique(unique_stops.begin(), unique_stops.end()) -
+                 unique_stops.begin();
+
+  GeoRoute route;
+  route.Reserve(bus.stops.size());
+  for (auto stop : bus.stops) route.Add(sm_.GetTrig(stop));
+  std::vector<double> segments;
+  CalculateGeoLengths(route, segments);
+  double len_geo = std::accumulate(segments.begin(), segments.end(), 0.0);
   if (!is_looped) len_geo *= 2;
 
-  auto GetRoadDistance = [&](std::string& x, std::string& y) {
-    auto& stop1 = sm_.Get().at(x);
-    auto& stop2 = sm_.Get().at(y);
-    if (stop1.distances.find(y) == stop1.distances.end())
-      return stop2.distances.at(x);
-    else
-      return stop1.distances.at(y);
+  auto GetRoadDistance = [&](StopId x, StopId y) {
+    return sm_.GetRoadDistance(x, y);
   };
 
   int len_road = AccumulateWithNext<int>(bus.stops.begin(), bus.stops.end(),
@@ -124,7 +195,7 @@ BusManager::ProcessResult BusManager::Process(const std::string& bus_id) {
     len_road += AccumulateWithNext<int>(bus.stops.rbegin(), bus.stops.rend(),
                                         GetRoadDistance);
 
-  return {true, bus_id, n, n_unique, len_road, len_geo};
+  return {n, n_unique, len_road, len_geo};
 }
 
 template <class T>
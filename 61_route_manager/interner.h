@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Assigns dense ids [0, Size()) to names in order of first appearance.
+// Names are stored in a deque, so views returned by GetName stay valid.
+// Ids are found by linear probing over a flat table of hash tags and ids:
+// a lookup reads one or two adjacent slots and compares a single name on a
+// hit, where a node-based map follows a bucket, a node and the name.
+class Interner {
+ public:
+  using Id = uint32_t;
+
+  Id Intern(std::string_view name);
+  std::optional<Id> Find(std::string_view name) const;
+  const std::string& GetName(Id id) const { return names_[id]; }
+  size_t Size() const { return names_.size(); }
+
+ private:
+  struct Slot {
+    uint32_t tag;  // High half of the name hash
+    Id id_plus_one;  // 0 marks an empty slot
+  };
+
+  static size_t Hash(std::string_view name) {
+    return std::hash<std::string_view>()(name);
+  }
+  // Index of the slot holding name, or of the empty slot it belongs to.
+  // The table must not be empty.
+  size_t Probe(std::string_view name, size_t hash) const;
+  void Rehash(size_t slot_count);
+  // Grows the table so that count names keep it at most half full
+  void Reserve(size_t count);
+
+  std::deque<std::string> names_;
+  // Empty or a power of two in size, never more than half full
+  std::vector<Slot> slots_;
+};
+
+size_t Interner::Probe(std::string_view name, size_t hash) const {
+  const size_t mask = slots_.size() - 1;
+  const auto tag = static_cast<uint32_t>(uint64_t(hash) >> 32);
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    auto& slot = slots_[i];
+    if (slot.id_plus_one == 0 ||
+        (slot.tag == tag && names_[slot.id_plus_one - 1] == name))
+      return i;
+  }
+}
+
+void Interner::Rehash(size_t slot_count) {
+  slots_.assign(slot_count, {0, 0});
+  for (Id id = 0; id < names_.size(); ++id) {
+    auto hash = Hash(names_[id]);
+    slots_[Probe(names_[id], hash)] = {
+        static_cast<uint32_t>(uint64_t(hash) >> 32), id + 1};
+  }
+}
+
+void Interner::Reserve(size_t count) {
+  if (2 * count <= slots_.size()) return;
+  size_t slot_count = 16;
+  while (slot_count < 2 * count) slot_count *= 2;
+  Rehash(slot_count);
+}
+
+Interner::Id Interner::Intern(std::string_view name) {
+  Reserve(names_.size() + 1);
+  auto hash = Hash(name);
+  auto& slot = slots_[Probe(name, hash)];
+  if (slot.id_plus_one != 0) return slot.id_plus_one - 1;
+
+  Id id = names_.size();
+  names_.emplace_back(name);
+  slot = {static_cast<uint32_t>(uint64_t(hash) >> 32), id + 1};
+  return id;
+}
+
+std::optional<Interner::Id> Interner::Find(std::string_view name) const {
+  if (slots_.empty()) return std::nullopt;
+  auto& slot = slots_[Probe(name, Hash(name))];
+  if (slot.id_plus_one == 0) return std::nullopt;
+  return slot.id_plus_one - 1;
+}
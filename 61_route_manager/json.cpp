@@ -1,5 +1,18 @@
 #include "json.h"
+#include "../mapped_file.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JSON_SCAN_X86
+#endif
 
 using namespace std;
 
@@ -16,8 +29,7 @@ std::variant<int, double> ReadNumber(std::istream& is) {
 }
 
 std::ostream& operator<<(std::ostream& os, const Json::Document& doc) {
-  auto str = doc.GetRoot().ToString();
-  os << str;
+  Json::Writer(os).Write(doc.GetRoot());
   return os;
 }
 
@@ -27,6 +39,138 @@ Document::Document(Node root) : root(move(root)) {}
 
 const Node& Document::GetRoot() const { return root; }
 
+void* Arena::Allocate(size_t size, size_t align) {
+  static constexpr size_t kBlockSize = 64 << 10;
+
+  size_t padding = -reinterpret_cast<uintptr_t>(free_) & (align - 1);
+  if (padding + size > left_) {
+    // Oversized requests get a block of their own, the current one is kept
+    size_t block_size = max(size + align, kBlockSize);
+    blocks_.emplace_back(new char[block_size]);
+    char* block = blocks_.back().get();
+    if (block_size > kBlockSize) {
+      return block + (-reinterpret_cast<uintptr_t>(block) & (align - 1));
+    }
+    free_ = block;
+    left_ = block_size;
+    padding = -reinterpret_cast<uintptr_t>(free_) & (align - 1);
+  }
+  void* result = free_ + padding;
+  free_ += padding + size;
+  left_ -= padding + size;
+  return result;
+}
+
+ArenaNode ArenaNode::MakeArray(Span<ArenaNode> items) {
+  ArenaNode node(Type::Array, items.size());
+  node.items_ = items.begin();
+  return node;
+}
+
+ArenaNode ArenaNode::MakeMap(Span<ArenaMember> members) {
+  ArenaNode node(Type::Map, members.size());
+  node.members_ = members.begin();
+  return node;
+}
+
+ArenaNode ArenaNode::MakeInt(int value) {
+  ArenaNode node(Type::Int, 0);
+  node.int_ = value;
+  return node;
+}
+
+ArenaNode ArenaNode::MakeDouble(double value) {
+  ArenaNode node(Type::Double, 0);
+  node.double_ = value;
+  return node;
+}
+
+ArenaNode ArenaNode::MakeBoolean(bool value) {
+  ArenaNode node(Type::Boolean, 0);
+  node.boolean_ = value;
+  return node;
+}
+
+ArenaNode ArenaNode::MakeString(string_view value) {
+  ArenaNode node(Type::String, value.size());
+  node.chars_ = value.data();
+  return node;
+}
+
+void ArenaNode::Expect(Type type) const {
+  if (type_ != type) throw bad_variant_access();
+}
+
+Span<ArenaNode> ArenaNode::AsArray() const {
+  Expect(Type::Array);
+  return {items_, size_};
+}
+
+Span<ArenaMember> ArenaNode::AsMap() const {
+  Expect(Type::Map);
+  return {members_, size_};
+}
+
+int ArenaNode::AsInt() const {
+  Expect(Type::Int);
+  return int_;
+}
+
+double ArenaNode::AsDouble() const {
+  if (IsInt()) return int_;
+  Expect(Type::Double);
+  return double_;
+}
+
+bool ArenaNode::AsBoolean() const {
+  Expect(Type::Boolean);
+  return boolean_;
+}
+
+string_view ArenaNode::AsString() const {
+  Expect(Type::String);
+  return {chars_, size_};
+}
+
+const ArenaNode* ArenaNode::Find(string_view key) const {
+  auto members = AsMap();
+  auto it = lower_bound(
+      members.begin(), members.end(), key,
+      [](auto& member, auto key) { return member.key < key; });
+  return it != members.end() && it->key == key ? &it->value : nullptr;
+}
+
+const ArenaNode& ArenaNode::At(string_view key) const {
+  if (auto value = Find(key)) return *value;
+  throw out_of_range("No key "s + string(key) + " in JSON object");
+}
+
+Node ArenaNode::ToNode() const {
+  switch (type_) {
+    case Type::Array: {
+      vector<Node> result;
+      result.reserve(size_);
+      for (auto& item : AsArray()) result.push_back(item.ToNode());
+      return Node(move(result));
+    }
+    case Type::Map: {
+      map<string, Node> result;
+      for (auto& [key, value] : AsMap())
+        result.emplace_hint(result.end(), string(key), value.ToNode());
+      return Node(move(result));
+    }
+    case Type::Int:
+      return Node(int_);
+    case Type::Double:
+      return Node(double_);
+    case Type::Boolean:
+      return Node(boolean_);
+    case Type::String:
+      return Node(string(AsString()));
+  }
+  return Node();
+}
+
 Node LoadNode(istream& input);
 
 Node LoadArray(istream& input) {
@@ -99,4 +243,576 @@ Node LoadNode(istream& input) {
 
 Document Load(istream& input) { return Document{LoadNode(input)}; }
 
+namespace {
+
+struct BlockMasks {
+  uint64_t quotes;
+  uint64_t operators;
+};
+
+// Classifies 64 bytes: bit i of a mask is set when block[i] is a quote
+// or one of {}[]:, respectively. Brackets are folded into braces by
+// setting bit 0x20 ('[' | 0x20 == '{', ']' | 0x20 == '}').
+[[maybe_unused]] BlockMasks ClassifyScalar(const char* block) {
+  BlockMasks masks{0, 0};
+  for (int i = 0; i < 64; ++i) {
+    char c = block[i];
+    char folded = c | 0x20;
+    uint64_t bit = uint64_t(1) << i;
+    if (c == '"')
+      masks.quotes |= bit;
+    else if (folded == '{' || folded == '}' || c == ':' || c == ',')
+      masks.operators |= bit;
+  }
+  return masks;
+}
+
+#ifdef JSON_SCAN_X86
+BlockMasks ClassifySse2(const char* block) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i lower = _mm_set1_epi8(0x20);
+  const __m128i open = _mm_set1_epi8('{');
+  const __m128i close = _mm_set1_epi8('}');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i comma = _mm_set1_epi8(',');
+
+  BlockMasks masks{0, 0};
+  for (int i = 0; i < 4; ++i) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block) + i);
+    __m128i folded = _mm_or_si128(v, lower);
+    __m128i ops = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(folded, open),
+                     _mm_cmpeq_epi8(folded, close)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+    uint64_t quotes = uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)));
+    masks.quotes |= quotes << (16 * i);
+    masks.operators |= uint64_t(uint16_t(_mm_movemask_epi8(ops))) << (16 * i);
+  }
+  return masks;
+}
+
+__attribute__((target("avx2"))) BlockMasks ClassifyAvx2(const char* block) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i lower = _mm256_set1_epi8(0x20);
+  const __m256i open = _mm256_set1_epi8('{');
+  const __m256i close = _mm256_set1_epi8('}');
+  const __m256i colon = _mm256_set1_epi8(':');
+  const __m256i comma = _mm256_set1_epi8(',');
+
+  BlockMasks masks{0, 0};
+  for (int i = 0; i < 2; ++i) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block) + i);
+    __m256i folded = _mm256_or_si256(v, lower);
+    __m256i ops = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(folded, open),
+                        _mm256_cmpeq_epi8(folded, close)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, colon),
+                        _mm256_cmpeq_epi8(v, comma)));
+    uint64_t quotes =
+        uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote)));
+    masks.quotes |= quotes << (32 * i);
+    masks.operators |= uint64_t(uint32_t(_mm256_movemask_epi8(ops)))
+                       << (32 * i);
+  }
+  return masks;
+}
+#endif
+
+using Classifier = BlockMasks (*)(const char*);
+
+Classifier PickClassifier() {
+#ifdef JSON_SCAN_X86
+  if (__builtin_cpu_supports("avx2")) return ClassifyAvx2;
+  return ClassifySse2;
+#else
+  return ClassifyScalar;
+#endif
+}
+
+// Bit i of the result is the xor of bits 0..i of x
+uint64_t PrefixXor(uint64_t x) {
+  for (int shift = 1; shift < 64; shift *= 2) x ^= x << shift;
+  return x;
+}
+
+}  // namespace
+
+vector<uint32_t> ScanStructure(string_view input) {
+  static const Classifier classify = PickClassifier();
+
+  vector<uint32_t> result;
+  result.reserve(input.size() / 8);
+  // All ones while the previous block ended inside a string
+  uint64_t in_string = 0;
+  char tail[64];
+  for (size_t base = 0; base < input.size(); base += 64) {
+    const char* block = input.data() + base;
+    if (input.size() - base < 64) {
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, block, input.size() - base);
+      block = tail;
+    }
+    auto [quotes, operators] = classify(block);
+    // Set from an opening quote up to, not including, the closing one
+    uint64_t inside = PrefixXor(quotes) ^ in_string;
+    in_string = uint64_t(int64_t(inside) >> 63);
+
+    for (uint64_t bits = (operators & ~inside) | quotes; bits;
+         bits &= bits - 1)
+      result.push_back(base + __builtin_ctzll(bits));
+  }
+  return result;
+}
+
+Node LoadNumber(string_view& input) {
+  const char* end = input.data() + input.size();
+  int integer;
+  auto result = from_chars(input.data(), end, integer);
+  if (result.ptr != end &&
+      (*result.ptr == '.' || *result.ptr == 'e' || *result.ptr == 'E')) {
+    double rational;
+    result = from_chars(input.data(), end, rational);
+    input.remove_prefix(result.ptr - input.data());
+    return Node(rational);
+  }
+  if (result.ec != errc()) throw invalid_argument("Bad number in JSON");
+  input.remove_prefix(result.ptr - input.data());
+  return Node(integer);
+}
+
+Node LoadBoolean(string_view& input) {
+  for (auto [word, value] : {pair{"true"sv, true}, pair{"false"sv, false}}) {
+    if (input.substr(0, word.size()) == word) {
+      input.remove_prefix(word.size());
+      return Node(value);
+    }
+  }
+  throw invalid_argument("Bad boolean in JSON");
+}
+
+// Walks the structural index of a buffer. Strings are cut between quote
+// pairs, scalars are parsed from the gap before the next structural char.
+class IndexCursor {
+ protected:
+  IndexCursor(string_view input, const vector<uint32_t>& index)
+      : input_(input), index_(index) {}
+
+  size_t Peek() const {
+    return pos_ < index_.size() ? index_[pos_] : input_.size();
+  }
+
+  size_t Next() {
+    if (pos_ == index_.size()) throw invalid_argument("Unexpected JSON end");
+    return index_[pos_++];
+  }
+
+  size_t SkipSpaces(size_t from) const {
+    while (from < input_.size() && isspace(input_[from])) ++from;
+    return from;
+  }
+
+  // Called after the opening bracket, consumes the closing one
+  bool AtEnd(size_t from, char end) {
+    if (SkipSpaces(from) != Peek()) return false;
+    if (Peek() == input_.size()) throw invalid_argument("Unexpected JSON end");
+    if (input_[Peek()] != end) return false;
+    ++pos_;
+    return true;
+  }
+
+  // Called after the opening quote, consumes the closing one
+  string_view ReadString() {
+    size_t begin = index_[pos_ - 1] + 1;
+    return input_.substr(begin, Next() - begin);
+  }
+
+  // Non-empty if a number or boolean starts at from
+  string_view Scalar(size_t from) const {
+    return input_.substr(from, Peek() - from);
+  }
+
+  string_view input_;
+  const vector<uint32_t>& index_;
+  size_t pos_ = 0;
+};
+
+class IndexedLoader : IndexCursor {
+ public:
+  IndexedLoader(string_view input, const vector<uint32_t>& index)
+      : IndexCursor(input, index) {}
+
+  Node LoadNode(size_t from) {
+    from = SkipSpaces(from);
+    if (from != Peek()) {
+      auto scalar = Scalar(from);
+      if (std::isdigit(scalar.front()) || scalar.front() == '-')
+        return LoadNumber(scalar);
+      return LoadBoolean(scalar);
+    }
+
+    char c = input_[Next()];
+    if (c == '[') {
+      return LoadArray();
+    } else if (c == '{') {
+      return LoadDict();
+    } else if (c == '"') {
+      return Node(LoadString());
+    }
+    throw invalid_argument("Unexpected '"s + c + "' in JSON");
+  }
+
+ private:
+  string LoadString() { return string(ReadString()); }
+
+  Node LoadArray() {
+    vector<Node> result;
+    size_t from = index_[pos_ - 1] + 1;
+    if (AtEnd(from, ']')) return Node(move(result));
+
+    do {
+      result.push_back(LoadNode(from));
+      from = Next() + 1;
+    } while (input_[from - 1] == ',');
+
+    return Node(move(result));
+  }
+
+  Node LoadDict() {
+    map<string, Node> result;
+    if (AtEnd(index_[pos_ - 1] + 1, '}')) return Node(move(result));
+
+    size_t from;
+    do {
+      Next();  // opening quote of the key
+      string key = LoadString();
+      from = Next() + 1;  // colon
+      result.emplace(move(key), LoadNode(from));
+      from = Next() + 1;
+    } while (input_[from - 1] == ',');
+
+    return Node(move(result));
+  }
+};
+
+// Same walk as IndexedLoader. Children of open containers are collected on
+// shared stacks and copied into the arena as one span when a container ends.
+class ArenaLoader : IndexCursor {
+ public:
+  ArenaLoader(string_view input, const vector<uint32_t>& index, Arena& arena)
+      : IndexCursor(input, index), arena_(arena) {}
+
+  ArenaNode LoadNode(size_t from) {
+    from = SkipSpaces(from);
+    if (from != Peek()) {
+      auto scalar = Scalar(from);
+      if (std::isdigit(scalar.front()) || scalar.front() == '-') {
+        auto number = LoadNumber(scalar);
+        return number.IsInt() ? ArenaNode::MakeInt(number.AsInt())
+                              : ArenaNode::MakeDouble(number.AsDouble());
+      }
+      return ArenaNode::MakeBoolean(LoadBoolean(scalar).AsBoolean());
+    }
+
+    char c = input_[Next()];
+    if (c == '[') {
+      return LoadArray();
+    } else if (c == '{') {
+      return LoadDict();
+    } else if (c == '"') {
+      return ArenaNode::MakeString(LoadString());
+    }
+    throw invalid_argument("Unexpected '"s + c + "' in JSON");
+  }
+
+ private:
+  string_view LoadString() {
+    auto value = ReadString();
+    char* chars = arena_.Allocate<char>(value.size());
+    memcpy(chars, value.data(), value.size());
+    return {chars, value.size()};
+  }
+
+  template <typename T>
+  Span<T> MoveToArena(vector<T>& stack, size_t first) {
+    size_t count = stack.size() - first;
+    T* data = arena_.Allocate<T>(count);
+    uninitialized_copy(stack.begin() + first, stack.end(), data);
+    stack.resize(first);
+    return {data, count};
+  }
+
+  ArenaNode LoadArray() {
+    size_t first = items_.size();
+    size_t from = index_[pos_ - 1] + 1;
+    if (!AtEnd(from, ']')) {
+      do {
+        auto item = LoadNode(from);
+        items_.push_back(item);
+        from = Next() + 1;
+      } while (input_[from - 1] == ',');
+    }
+    return ArenaNode::MakeArray(MoveToArena(items_, first));
+  }
+
+  ArenaNode LoadDict() {
+    size_t first = members_.size();
+    if (!AtEnd(index_[pos_ - 1] + 1, '}')) {
+      size_t from;
+      do {
+        Next();  // opening quote of the key
+        auto key = LoadString();
+        from = Next() + 1;  // colon
+        auto value = LoadNode(from);
+        members_.push_back({key, value});
+        from = Next() + 1;
+      } while (input_[from - 1] == ',');
+    }
+
+    // Keep the first of duplicate keys, as map::emplace does
+    auto begin = members_.begin() + first;
+    stable_sort(begin, members_.end(),
+                [](auto& lhs, auto& rhs) { return lhs.key < rhs.key; });
+    auto same_key = [](auto& lhs, auto& rhs) { return lhs.key == rhs.key; };
+    members_.erase(unique(begin, members_.end(), same_key), members_.end());
+    return ArenaNode::MakeMap(MoveToArena(members_, first));
+  }
+
+  Arena& arena_;
+  vector<ArenaNode> items_;
+  vector<ArenaMember> members_;
+};
+
+Document LoadFromBuffer(string_view input) {
+  auto index = ScanStructure(input);
+  return Document{IndexedLoader(input, index).LoadNode(0)};
+}
+
+Document LoadFromFile(const string& path) {
+  MappedFile file(path);
+  return LoadFromBuffer(file.Data());
+}
+
+ArenaDocument LoadArenaFromBuffer(string_view input) {
+  auto index = ScanStructure(input);
+  Arena arena;
+  auto root = ArenaLoader(input, index, arena).LoadNode(0);
+  return ArenaDocument(move(arena), root);
+}
+
+ArenaDocument LoadArenaFromFile(const string& path) {
+  MappedFile file(path);
+  return LoadArenaFromBuffer(file.Data());
+}
+
+void NodeBuilder::BeginArray() { open_.push_back(Node(vector<Node>())); }
+
+void NodeBuilder::EndArray() { Close(); }
+
+void NodeBuilder::BeginMap() { open_.push_back(Node(map<string, Node>())); }
+
+void NodeBuilder::Key(string key) { keys_.push_back(move(key)); }
+
+void NodeBuilder::EndMap() { Close(); }
+
+void NodeBuilder::Int(int value) { Add(Node(value)); }
+
+void NodeBuilder::Double(double value) { Add(Node(value)); }
+
+void NodeBuilder::Boolean(bool value) { Add(Node(value)); }
+
+void NodeBuilder::String(string value) { Add(Node(move(value))); }
+
+Node NodeBuilder::TakeResult() {
+  auto node = move(*result_);
+  result_.reset();
+  return node;
+}
+
+void NodeBuilder::Close() {
+  auto node = move(open_.back());
+  open_.pop_back();
+  Add(move(node));
+}
+
+void NodeBuilder::Add(Node node) {
+  if (open_.empty()) {
+    result_ = move(node);
+  } else if (open_.back().IsArray()) {
+    open_.back().AsArray().push_back(move(node));
+  } else {
+    open_.back().AsMap().emplace(move(keys_.back()), move(node));
+    keys_.pop_back();
+  }
+}
+
+void ParseNode(istream& input, Handler& handler);
+
+void ParseArray(istream& input, Handler& handler) {
+  handler.BeginArray();
+  for (char c; input >> c && c != ']';) {
+    if (c != ',') {
+      input.putback(c);
+    }
+    ParseNode(input, handler);
+  }
+  handler.EndArray();
+}
+
+void ParseNumber(istream& input, Handler& handler) {
+  auto result = ReadNumber(input);
+  if (std::holds_alternative<int>(result))
+    handler.Int(std::get<int>(result));
+  else
+    handler.Double(std::get<double>(result));
+}
+
+void ParseBoolean(istream& input, Handler& handler) {
+  bool result;
+  input >> std::boolalpha >> result;
+  handler.Boolean(result);
+}
+
+string ReadString(istream& input) {
+  string line;
+  getline(input, line, '"');
+  return line;
+}
+
+void ParseDict(istream& input, Handler& handler) {
+  handler.BeginMap();
+  for (char c; input >> c && c != '}';) {
+    if (c == ',') {
+      input >> c;
+    }
+
+    handler.Key(ReadString(input));
+    input >> c;
+    ParseNode(input, handler);
+  }
+  handler.EndMap();
+}
+
+void ParseNode(istream& input, Handler& handler) {
+  char c;
+  input >> c;
+
+  if (c == '[') {
+    ParseArray(input, handler);
+  } else if (c == '{') {
+    ParseDict(input, handler);
+  } else if (c == '"') {
+    handler.String(ReadString(input));
+  } else if (std::isdigit(c) || c == '-') {
+    input.putback(c);
+    ParseNumber(input, handler);
+  } else {
+    input.putback(c);
+    ParseBoolean(input, handler);
+  }
+}
+
+void Parse(istream& input, Handler& handler) { ParseNode(input, handler); }
+
+string Node::ToString() const {
+  Writer writer;
+  writer.Write(*this);
+  return writer.TakeBuffer();
+}
+
+void Writer::Write(const Node& node) {
+  static constexpr size_t kFlushSize = 64 << 10;
+
+  if (node.IsArray()) {
+    buffer_ += '[';
+    bool first = true;
+    for (auto& item : node.AsArray()) {
+      if (!first) buffer_ += ',';
+      first = false;
+      Write(item);
+    }
+    buffer_ += ']';
+  } else if (node.IsMap()) {
+    buffer_ += '{';
+    bool first = true;
+    for (const auto& [key, value] : node.AsMap()) {
+      if (!first) buffer_ += ',';
+      first = false;
+      WriteString(key);
+      buffer_ += ':';
+      Write(value);
+    }
+    buffer_ += '}';
+  } else if (node.IsDouble()) {
+    WriteDouble(node.AsDouble());
+  } else if (node.IsInt()) {
+    WriteInt(node.AsInt());
+  } else if (node.IsString()) {
+    WriteString(node.AsString());
+  } else if (node.IsBoolean()) {
+    buffer_ += node.AsBoolean() ? "true" : "false";
+  }
+
+  if (os_ && buffer_.size() >= kFlushSize) Flush();
+}
+
+void Writer::Flush() {
+  if (!os_ || buffer_.empty()) return;
+  os_->write(buffer_.data(), buffer_.size());
+  buffer_.clear();
+}
+
+void Writer::WriteString(string_view value) {
+  static constexpr char kHex[] = "0123456789abcdef";
+
+  buffer_ += '"';
+  for (char c : value) {
+    switch (c) {
+      case '"':
+        buffer_ += "\\\"";
+        break;
+      case '\\':
+        buffer_ += "\\\\";
+        break;
+      case '\b':
+        buffer_ += "\\b";
+        break;
+      case '\f':
+        buffer_ += "\\f";
+        break;
+      case '\n':
+        buffer_ += "\\n";
+        break;
+      case '\r':
+        buffer_ += "\\r";
+        break;
+      case '\t':
+        buffer_ += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          buffer_ += "\\u00";
+          buffer_ += kHex[c >> 4];
+          buffer_ += kHex[c & 0xf];
+        } else {
+          buffer_ += c;
+        }
+    }
+  }
+  buffer_ += '"';
+}
+
+void Writer::WriteInt(int value) {
+  char chars[16];
+  auto result = to_chars(begin(chars), end(chars), value);
+  buffer_.append(chars, result.ptr);
+}
+
+void Writer::WriteDouble(double value) {
+  char chars[32];
+  auto result =
+      to_chars(begin(chars), end(chars), value, chars_format::general, 6);
+  buffer_.append(chars, result.ptr);
+}
+
 }  // namespace Json
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <cstdint>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
@@ -48,41 +52,8 @@ class Node : public std::variant<std::vector<Node>, std::map<std::string, Node>,
   bool IsBoolean() const { return std::holds_alternative<bool>(*this); }
   bool IsString() const { return std::holds_alternative<std::string>(*this); }
 
-  std::string ToString() const {
-    std::stringstream ss;
-    if (IsArray()) {
-      ss << '[';
-      for (auto& x : AsArray()) ss << x.ToString() << ',';
-      auto out = ss.str();
-      if (out == "[")
-        out.push_back(']');
-      else
-        out.back() = ']';
-      return out;
-    } else if (IsMap()) {
-      ss << '{';
-      for (const auto& [key, value] : AsMap())
-        ss << "\"" << key << "\":" << value.ToString() << ',';
-      auto out = ss.str();
-      if (out == "{")
-        out.push_back('}');
-      else
-        out.back() = '}';
-      return out;
-    } else if (IsDouble()) {
-      ss << AsDouble();
-      return ss.str();
-    } else if (IsInt()) {
-      ss << AsInt();
-      return ss.str();
-    } else if (IsString()) {
-      ss << '"' << AsString() << '"';
-      return ss.str();
-    } else if (IsBoolean())
-      return AsBoolean() ? "true" : "false";
-    else
-      return "";
-  }
+  // Compact JSON text of the node, see Writer
+  std::string ToString() const;
 };
 
 class Document {
@@ -95,7 +66,204 @@ class Document {
   Node root;
 };
 
+// Bump allocator: memory is handed out from large blocks that are only
+// released, all at once, when the arena is destroyed
+class Arena {
+ public:
+  Arena() = default;
+  Arena(Arena&&) = default;
+  Arena& operator=(Arena&&) = default;
+
+  void* Allocate(size_t size, size_t align);
+  template <typename T>
+  T* Allocate(size_t count) {
+    return static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+  }
+
+ private:
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  char* free_ = nullptr;
+  size_t left_ = 0;
+};
+
+template <typename T>
+class Span {
+ public:
+  Span() = default;
+  Span(const T* data, size_t size) : data_(data), size_(size) {}
+
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const T& operator[](size_t i) const { return data_[i]; }
+  const T& front() const { return data_[0]; }
+  const T& back() const { return data_[size_ - 1]; }
+
+ private:
+  const T* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+struct ArenaMember;
+
+// Read-only counterpart of Node whose arrays, objects and strings live in
+// the arena of an ArenaDocument. Objects are sorted by key.
+class ArenaNode {
+ public:
+  enum class Type : uint8_t { Array, Map, Int, Double, Boolean, String };
+
+  ArenaNode() : ArenaNode(Type::Int, 0) { int_ = 0; }
+  static ArenaNode MakeArray(Span<ArenaNode> items);
+  static ArenaNode MakeMap(Span<ArenaMember> members);
+  static ArenaNode MakeInt(int value);
+  static ArenaNode MakeDouble(double value);
+  static ArenaNode MakeBoolean(bool value);
+  static ArenaNode MakeString(std::string_view value);
+
+  Type GetType() const { return type_; }
+  bool IsArray() const { return type_ == Type::Array; }
+  bool IsMap() const { return type_ == Type::Map; }
+  bool IsInt() const { return type_ == Type::Int; }
+  bool IsDouble() const { return type_ == Type::Double; }
+  bool IsBoolean() const { return type_ == Type::Boolean; }
+  bool IsString() const { return type_ == Type::String; }
+
+  // Accessors throw std::bad_variant_access on a type mismatch, like Node
+  Span<ArenaNode> AsArray() const;
+  Span<ArenaMember> AsMap() const;
+  int AsInt() const;
+  double AsDouble() const;
+  bool AsBoolean() const;
+  std::string_view AsString() const;
+
+  // Binary search over the members of an object
+  const ArenaNode* Find(std::string_view key) const;
+  // Throws std::out_of_range if the key is missing
+  const ArenaNode& At(std::string_view key) const;
+
+  // Deep copy into a heap-allocated Node
+  Node ToNode() const;
+
+ private:
+  ArenaNode(Type type, uint32_t size) : type_(type), size_(size) {}
+  void Expect(Type type) const;
+
+  Type type_;
+  uint32_t size_;
+  union {
+    const ArenaNode* items_;
+    const ArenaMember* members_;
+    const char* chars_;
+    int int_;
+    double double_;
+    bool boolean_;
+  };
+};
+
+struct ArenaMember {
+  std::string_view key;
+  ArenaNode value;
+};
+
+// Owns the arena every node of the tree is allocated from, so destroying
+// it frees the whole tree at once
+class ArenaDocument {
+ public:
+  ArenaDocument(Arena arena, ArenaNode root)
+      : arena(std::move(arena)), root(root) {}
+
+  const ArenaNode& GetRoot() const { return root; }
+
+ private:
+  Arena arena;
+  ArenaNode root;
+};
+
 Document Load(std::istream& input);
+// Offsets of the structural characters {}[]:, outside of strings and of
+// every quote, in increasing order. Inputs must be smaller than 4 GiB.
+std::vector<uint32_t> ScanStructure(std::string_view input);
+// Parses a document from contiguous memory using ScanStructure
+Document LoadFromBuffer(std::string_view input);
+// Maps the file into memory and parses it with LoadFromBuffer
+Document LoadFromFile(const std::string& path);
+// Same as LoadFromBuffer, but builds the tree in a single arena. Strings
+// are copied, the document does not refer to input.
+ArenaDocument LoadArenaFromBuffer(std::string_view input);
+ArenaDocument LoadArenaFromFile(const std::string& path);
+
+// Receives parsing events from Parse in document order
+class Handler {
+ public:
+  virtual ~Handler() = default;
+
+  virtual void BeginArray() = 0;
+  virtual void EndArray() = 0;
+  virtual void BeginMap() = 0;
+  virtual void Key(std::string key) = 0;
+  virtual void EndMap() = 0;
+  virtual void Int(int value) = 0;
+  virtual void Double(double value) = 0;
+  virtual void Boolean(bool value) = 0;
+  virtual void String(std::string value) = 0;
+};
+
+// Assembles the values passed to it back into a Node
+class NodeBuilder : public Handler {
+ public:
+  void BeginArray() override;
+  void EndArray() override;
+  void BeginMap() override;
+  void Key(std::string key) override;
+  void EndMap() override;
+  void Int(int value) override;
+  void Double(double value) override;
+  void Boolean(bool value) override;
+  void String(std::string value) override;
+
+  // True once a complete top-level value has been received
+  bool HasResult() const { return result_.has_value(); }
+  Node TakeResult();
+
+ private:
+  void Close();
+  void Add(Node node);
+
+  std::vector<Node> open_;
+  std::vector<std::string> keys_;
+  std::optional<Node> result_;
+};
+
+// Reads one value from input without building a Node tree
+void Parse(std::istream& input, Handler& handler);
+
+// Serializes nodes as compact JSON into a buffer that is reused between
+// calls. Numbers go through std::to_chars, doubles with 6 significant
+// digits like the default ostream format. With a stream attached the
+// buffer is flushed into it whenever it fills up and on destruction.
+class Writer {
+ public:
+  Writer() = default;
+  explicit Writer(std::ostream& os) : os_(&os) {}
+  Writer(const Writer&) = delete;
+  Writer& operator=(const Writer&) = delete;
+  ~Writer() { Flush(); }
+
+  void Write(const Node& node);
+  void Flush();
+  // Text written since the last flush
+  const std::string& Buffer() const { return buffer_; }
+  std::string TakeBuffer() { return std::move(buffer_); }
+
+ private:
+  void WriteString(std::string_view value);
+  void WriteInt(int value);
+  void WriteDouble(double value);
+
+  std::ostream* os_ = nullptr;
+  std::string buffer_;
+};
 }  // namespace Json
 
-std::ostream& operator<<(std::ostream& os, const Json::Document& doc);
\ No newline at end of file
+std::ostream& operator<<(std::ostream& os, const Json::Document& doc);
\ No newline at end of file
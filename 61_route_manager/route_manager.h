@@ -0,0 +1,363 @@
+#pragma once
+
+#include "bus_manager.h"
+#include "common.h"
+#include "json.h"
+#include "snapshot.h"
+#include "stop_manager.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class RouteManager {
+ private:
+  StopManager sm_;
+  BusManager bm_;
+  // Created by the first parallel Process and kept for the next ones
+  std::unique_ptr<WorkerPool> pool_;
+
+  class StreamLoader;
+  void Load(const Json::Node& request);
+  template <class Manager>
+  Json::Node ProcessRequest(Manager& manager, const Json::ArenaNode& request);
+  std::optional<Json::Node> ProcessFrozen(const Json::Node& request) const;
+  static void ThrowErrors(const std::vector<std::string>& errors);
+
+ public:
+  RouteManager() : bm_(sm_) {}
+  RouteManager(const Json::Document& idoc) : bm_(sm_) { Load(idoc); }
+  // Loads the base requests of a text input straight from memory. Returns
+  // the rest of input after them.
+  std::string_view LoadText(std::string_view input);
+  void Load(const Json::Document& idoc);
+  void Load(const Json::ArenaDocument& idoc);
+  // Parses a JSON document from is, loading base requests as soon as each
+  // one is read. Returns the document without base_requests.
+  Json::Document LoadJson(std::istream& is);
+  // Reads the whole text input from is into one buffer, loads its base
+  // requests and answers the stat requests after them
+  std::vector<std::string> Process(std::istream& is);
+  // Answers the text stat requests at the start of input, such as the rest
+  // returned by LoadText
+  std::vector<std::string> ProcessText(std::string_view input);
+  Json::Document Process(const Json::Document& idoc);
+  // Saves the loaded base for RouteSnapshot, which answers the same
+  // stat requests straight from the mapped file
+  void SaveSnapshot(const std::string& path);
+  // Splits stat_requests into thread_count contiguous slices answered in
+  // parallel. The output is in request order, same as Process(idoc). Slices
+  // are at least kMinSlice requests, so one thread or a small batch is
+  // answered on the calling thread.
+  static constexpr size_t kMinSlice = 128;
+  Json::Document Process(const Json::Document& idoc, size_t thread_count);
+  Json::Document Process(const Json::ArenaDocument& idoc);
+  // Same as Process(idoc) without updating any state, so it is safe to call
+  // from several threads at once. Valid once loading is finished.
+  Json::Document ProcessFrozen(const Json::Document& idoc) const;
+};
+
+std::string_view RouteManager::LoadText(std::string_view input) {
+  auto count = RemoveSpaces(ReadLine(input));
+  int n = count.empty() ? 0 : Convert<int>(count);
+  while (n-- > 0 && !input.empty()) {
+    auto line = ReadLine(input);
+    line.remove_prefix(std::min(line.find_first_not_of(' '), line.size()));
+    auto request_type = ReadToken(line);
+    if (request_type == "Bus") {
+      bm_.Load(line);
+    } else if (request_type == "Stop") {
+      sm_.Load(line);
+    } else {
+    }
+  }
+  bm_.Freeze();
+  return input;
+}
+
+void RouteManager::Load(const Json::Node& request) {
+  auto& request_type = request.AsMap().at("type").AsString();
+  if (request_type == "Bus") {
+    bm_.Load(request);
+  } else if (request_type == "Stop") {
+    sm_.Load(request);
+  } else {
+  }
+}
+
+// Stops go first through StopManager::LoadBulk, then buses. Invalid stops
+// do not stop the load: they are skipped, and one invalid_argument listing
+// all of them is thrown once every other request is loaded.
+void RouteManager::Load(const Json::Document& idoc) {
+  auto& input_map = idoc.GetRoot().AsMap();
+  if (input_map.find("base_requests") == input_map.end()) return;
+  const auto& requests = input_map.at("base_requests").AsArray();
+  StopManager::BulkInput stops;
+  for (auto& req : requests)
+    if (req.AsMap().at("type").AsString() == "Stop") sm_.AddToBulk(stops, req);
+  auto errors = sm_.LoadBulk(stops);
+  for (auto& req : requests)
+    if (req.AsMap().at("type").AsString() == "Bus") bm_.Load(req);
+  bm_.Freeze();
+  ThrowErrors(errors);
+}
+
+void RouteManager::Load(const Json::ArenaDocument& idoc) {
+  auto requests = idoc.GetRoot().Find("base_requests");
+  if (!requests) return;
+  StopManager::BulkInput stops;
+  for (auto& req : requests->AsArray())
+    if (req.At("type").AsString() == "Stop") sm_.AddToBulk(stops, req);
+  auto errors = sm_.LoadBulk(stops);
+  for (auto& req : requests->AsArray())
+    if (req.At("type").AsString() == "Bus") bm_.Load(req);
+  bm_.Freeze();
+  ThrowErrors(errors);
+}
+
+void RouteManager::ThrowErrors(const std::vector<std::string>& errors) {
+  if (errors.empty()) return;
+  std::string message = errors.front();
+  for (size_t i = 1; i < errors.size(); ++i) message += "\n" + errors[i];
+  throw std::invalid_argument(message);
+}
+
+// Builds each element of the root base_requests array separately and drops
+// it once loaded. Buses go to RouteManager::Load right away, stops are
+// interned into a BulkInput for one LoadBulk call at the end. Other root
+// values are assembled as usual.
+class RouteManager::StreamLoader : public Json::Handler {
+ public:
+  explicit StreamLoader(RouteManager& rm) : rm_(rm) {}
+
+  void BeginArray() override {
+    if (depth_ == 1 && section_ == "base_requests")
+      streaming_ = true;
+    else if (depth_ >= 1)
+      builder_.BeginArray();
+    ++depth_;
+  }
+  void EndArray() override {
+    --depth_;
+    if (depth_ == 1 && streaming_)
+      streaming_ = false;
+    else if (depth_ >= 1)
+      builder_.EndArray();
+    Flush();
+  }
+  void BeginMap() override {
+    if (depth_ >= 1) builder_.BeginMap();
+    ++depth_;
+  }
+  void Key(std::string key) override {
+    if (depth_ == 1)
+      section_ = std::move(key);
+    else
+      builder_.Key(std::move(key));
+  }
+  void EndMap() override {
+    if (--depth_ >= 1) builder_.EndMap();
+    Flush();
+  }
+  void Int(int value) override {
+    builder_.Int(value);
+    Flush();
+  }
+  void Double(double value) override {
+    builder_.Double(value);
+    Flush();
+  }
+  void Boolean(bool value) override {
+    builder_.Boolean(value);
+    Flush();
+  }
+  void String(std::string value) override {
+    builder_.String(std::move(value));
+    Flush();
+  }
+
+  Json::Document TakeRest() {
+    return Json::Document(Json::Node(std::move(rest_)));
+  }
+  StopManager::BulkInput TakeStops() { return std::move(stops_); }
+
+ private:
+  void Flush() {
+    if (!builder_.HasResult()) return;
+    if (!streaming_) {
+      rest_[section_] = builder_.TakeResult();
+      return;
+    }
+    auto request = builder_.TakeResult();
+    if (request.AsMap().at("type").AsString() == "Stop")
+      rm_.sm_.AddToBulk(stops_, request);
+    else
+      rm_.Load(request);
+  }
+
+  RouteManager& rm_;
+  Json::NodeBuilder builder_;
+  int depth_ = 0;
+  bool streaming_ = false;
+  std::string section_;
+  std::map<std::string, Json::Node> rest_;
+  StopManager::BulkInput stops_;
+};
+
+Json::Document RouteManager::LoadJson(std::istream& is) {
+  StreamLoader loader(*this);
+  Json::Parse(is, loader);
+  auto errors = sm_.LoadBulk(loader.TakeStops());
+  bm_.Freeze();
+  ThrowErrors(errors);
+  return loader.TakeRest();
+}
+
+std::vector<std::string> RouteManager::Process(std::istream& is) {
+  std::string input{std::istreambuf_iterator<char>(is), {}};
+  return ProcessText(LoadText(input));
+}
+
+std::vector<std::string> RouteManager::ProcessText(std::string_view input) {
+  auto count = RemoveSpaces(ReadLine(input));
+  int n = count.empty() ? 0 : Convert<int>(count);
+  std::vector<std::string> output;
+
+  while (n-- > 0 && !input.empty()) {
+    auto line = ReadLine(input);
+    line.remove_prefix(std::min(line.find_first_not_of(' '), line.size()));
+    auto request_type = ReadToken(line);
+    auto name = std::string(RemoveSpaces(line));
+    if (request_type == "Bus") {
+      output.push_back(Convert<std::string>(bm_.Process(name)));
+    } else if (request_type == "Stop") {
+      output.push_back(Convert<std::string>(sm_.Process(name)));
+    } else {
+    }
+  }
+
+  return output;
+}
+
+Json::Document RouteManager::Process(const Json::Document& idoc) {
+  std::vector<Json::Node> output;
+  auto& input_map = idoc.GetRoot().AsMap();
+  if (input_map.find("stat_requests") == input_map.end())
+    return Json::Document({});
+  const auto& requests = input_map.at("stat_requests").AsArray();
+  for (auto& req : requests) {
+    auto& request_type = req.AsMap().at("type").AsString();
+    if (request_type == "Bus") {
+      auto res =
+          Convert<Json::Node>(bm_.Process(req.AsMap().at("name").AsString()));
+      res.AsMap()["request_id"] = req.AsMap().at("id");
+      output.push_back(res);
+    } else if (request_type == "Stop") {
+      auto res =
+          Convert<Json::Node>(sm_.Process(req.AsMap().at("name").AsString()));
+      res.AsMap()["request_id"] = req.AsMap().at("id");
+      output.push_back(res);
+    } else {
+    }
+  }
+  return Json::Document(Json::Node(std::move(output)));
+}
+
+std::optional<Json::Node> RouteManager::ProcessFrozen(
+    const Json::Node& request) const {
+  auto& request_map = request.AsMap();
+  auto& request_type = request_map.at("type").AsString();
+  std::optional<Json::Node> res;
+  if (request_type == "Bus") {
+    res = Convert<Json::Node>(
+        bm_.ProcessFrozen(request_map.at("name").AsString()));
+  } else if (request_type == "Stop") {
+    res = Convert<Json::Node>(sm_.Process(request_map.at("name").AsString()));
+  } else {
+    return res;
+  }
+  res->AsMap()["request_id"] = request_map.at("id");
+  return res;
+}
+
+Json::Document RouteManager::ProcessFrozen(
+    const Json::Document& idoc) const {
+  std::vector<Json::Node> output;
+  auto& input_map = idoc.GetRoot().AsMap();
+  if (input_map.find("stat_requests") == input_map.end())
+    return Json::Document({});
+  for (auto& req : input_map.at("stat_requests").AsArray())
+    if (auto res = ProcessFrozen(req)) output.push_back(std::move(*res));
+  return Json::Document(Json::Node(std::move(output)));
+}
+
+Json::Document RouteManager::Process(const Json::Document& idoc,
+                                     size_t thread_count) {
+  auto& input_map = idoc.GetRoot().AsMap();
+  if (input_map.find("stat_requests") == input_map.end())
+    return Json::Document({});
+  const auto& requests = input_map.at("stat_requests").AsArray();
+
+  bm_.Freeze();
+  // Unknown request types leave their slot empty
+  std::vector<std::optional<Json::Node>> slots(requests.size());
+  thread_count = std::clamp<size_t>(requests.size() / kMinSlice, 1,
+                                    std::max<size_t>(thread_count, 1));
+  size_t slice = (requests.size() + thread_count - 1) / thread_count;
+  auto process_slice = [&](size_t index) {
+    size_t begin = index * slice;
+    size_t end = std::min(begin + slice, requests.size());
+    for (size_t i = begin; i < end; ++i) slots[i] = ProcessFrozen(requests[i]);
+  };
+  if (thread_count == 1) {
+    process_slice(0);
+  } else {
+    if (!pool_ || pool_->Size() < thread_count - 1)
+      pool_ = std::make_unique<WorkerPool>(thread_count - 1);
+    pool_->ParallelFor(thread_count, process_slice);
+  }
+
+  std::vector<Json::Node> output;
+  output.reserve(slots.size());
+  for (auto& slot : slots)
+    if (slot) output.push_back(std::move(*slot));
+  return Json::Document(Json::Node(std::move(output)));
+}
+
+template <class Manager>
+Json::Node RouteManager::ProcessRequest(Manager& manager,
+                                        const Json::ArenaNode& request) {
+  auto res = Convert<Json::Node>(
+      manager.Process(std::string(request.At("name").AsString())));
+  res.AsMap()["request_id"] = Json::Node(request.At("id").AsInt());
+  return res;
+}
+
+Json::Document RouteManager::Process(const Json::ArenaDocument& idoc) {
+  std::vector<Json::Node> output;
+  auto requests = idoc.GetRoot().Find("stat_requests");
+  if (!requests) return Json::Document({});
+  for (auto& req : requests->AsArray()) {
+    auto request_type = req.At("type").AsString();
+    if (request_type == "Bus") {
+      output.push_back(ProcessRequest(bm_, req));
+    } else if (request_type == "Stop") {
+      output.push_back(ProcessRequest(sm_, req));
+    } else {
+    }
+  }
+  return Json::Document(Json::Node(std::move(output)));
+}
+
+void RouteManager::SaveSnapshot(const std::string& path) {
+  bm_.Freeze();
+  RouteSnapshot::Write(sm_, bm_, path);
+}
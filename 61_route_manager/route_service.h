@@ -0,0 +1,86 @@
+#pragma once
+
+#include "json.h"
+#include "route_manager.h"
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+
+// Serves stat requests from many threads over a route base that can be
+// replaced while they run. Each base is immutable once published and kept
+// alive by its readers, so a reload never changes an answer in progress.
+//
+// Readers do not touch a lock: each thread caches the shared_ptr of the
+// base it last used and only checks the atomic version_ against it, which
+// costs one load and one reference count increment. After a reload the
+// first read of each thread takes base_mutex_ once to pick up the new
+// base. An old base is freed once every thread that read it has moved on
+// to a newer one or exited.
+class RouteService {
+ public:
+  struct Base {
+    uint64_t version = 0;
+    RouteManager manager;
+  };
+
+  RouteService() : base_(std::make_shared<const Base>()) {}
+
+  std::shared_ptr<const Base> GetBase() const;
+  uint64_t GetVersion() const { return GetBase()->version; }
+
+  Json::Document Process(const Json::Document& idoc) const {
+    return GetBase()->manager.ProcessFrozen(idoc);
+  }
+
+  // Builds a base from the base_requests of idoc and publishes it.
+  // Returns its version.
+  uint64_t Reload(const Json::Document& idoc);
+  // Same as Reload, on a separate thread
+  std::future<uint64_t> ReloadAsync(Json::Document idoc) {
+    return std::async(std::launch::async,
+                      [this, idoc = std::move(idoc)] { return Reload(idoc); });
+  }
+
+ private:
+  // Base last read by a thread. One per thread, shared by all services, so
+  // it is tagged with a service id that is never reused, unlike an address.
+  struct ReaderCache {
+    uint64_t service_id = 0;
+    uint64_t version = 0;
+    std::shared_ptr<const Base> base;
+  };
+
+  static inline std::atomic<uint64_t> next_id_ = 1;
+  const uint64_t id_ = next_id_++;
+  // Version of base_, stored after it
+  std::atomic<uint64_t> version_ = 0;
+  // Guards base_ and orders reloads, readers take it only on the first
+  // read after a reload
+  mutable std::mutex base_mutex_;
+  std::shared_ptr<const Base> base_;
+};
+
+std::shared_ptr<const RouteService::Base> RouteService::GetBase() const {
+  static thread_local ReaderCache cache;
+  if (cache.service_id != id_ ||
+      cache.version != version_.load(std::memory_order_acquire)) {
+    std::lock_guard guard(base_mutex_);
+    cache = {id_, base_->version, base_};
+  }
+  return cache.base;
+}
+
+uint64_t RouteService::Reload(const Json::Document& idoc) {
+  // Built outside of the lock, RouteManager is not movable
+  auto base = std::make_shared<Base>();
+  base->manager.Load(idoc);
+
+  std::lock_guard guard(base_mutex_);
+  auto version = base->version = version_.load() + 1;
+  base_ = std::move(base);
+  version_.store(version, std::memory_order_release);
+  return version;
+}
@@ -0,0 +1,428 @@
+#pragma once
+
+#include "../mapped_file.h"
+#include "bus_manager.h"
+#include "json.h"
+#include "stop_manager.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Loaded route database saved as flat arrays, in native byte order. The
+// file is mapped as is and queried in place: names are found by binary
+// search over id lists sorted by name, every other table is indexed by id.
+class RouteSnapshot {
+ public:
+  using Id = uint32_t;
+  static constexpr uint32_t kVersion = 1;
+
+  // Managers must be frozen
+  static void Write(const StopManager& sm, const BusManager& bm,
+                    const std::string& path);
+
+  explicit RouteSnapshot(const std::string& path);
+
+  Json::Document Process(const Json::Document& idoc) const;
+
+  size_t StopCount() const { return header_->stop_count; }
+  size_t BusCount() const { return header_->bus_count; }
+  std::optional<Id> FindStop(std::string_view name) const;
+  std::optional<Id> FindBus(std::string_view name) const;
+  std::string_view GetStopName(Id stop) const;
+  std::string_view GetBusName(Id bus) const;
+  Coords GetCoords(Id stop) const { return stop_coords_[stop]; }
+  std::optional<int> GetRoadDistance(Id from, Id to) const;
+  // Buses through the stop, ordered by name
+  Json::Span<Id> GetBuses(Id stop) const;
+  Json::Span<Id> GetStops(Id bus) const;
+  bool IsLooped(Id bus) const { return bus_looped_[bus]; }
+
+ private:
+  enum Section : uint32_t {
+    kStopNameOffsets,
+    kStopNameChars,
+    kStopsByName,
+    kStopCoords,
+    kDistanceOffsets,
+    kDistanceTargets,
+    kDistanceLengths,
+    kStopBusOffsets,
+    kStopBuses,
+    kBusNameOffsets,
+    kBusNameChars,
+    kBusesByName,
+    kBusLooped,
+    kBusStopOffsets,
+    kBusStops,
+    kBusStats,
+    kSectionCount
+  };
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t stop_count;
+    uint32_t bus_count;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t offsets[kSectionCount];
+    uint64_t sizes[kSectionCount];
+  };
+  struct Stats {
+    int32_t stops_n;
+    int32_t stops_n_unique;
+    int32_t road_len;
+    // Nonzero if the route misses a road distance, the other fields are
+    // then unset and a request throws as BusManager::Process does
+    int32_t missing_distance;
+    double geo_len;
+  };
+  static constexpr char kMagic[8] = "RTESNAP";
+
+  class Builder;
+
+  template <typename T>
+  const T* Get(Section section, size_t count) const;
+  // Offsets of count + 1 ranges, validated to start at 0 and never decrease
+  const uint32_t* GetOffsets(Section section, size_t count) const;
+  // Ids, validated to be below limit
+  const Id* GetIds(Section section, size_t count, size_t limit) const;
+  std::optional<Id> Find(std::string_view name, const uint32_t* offsets,
+                         const char* chars, const Id* by_name,
+                         size_t count) const;
+  // Throws the out_of_range BusManager gives for the first missing pair
+  void ThrowMissingDistance(Id bus) const;
+  Json::Node ProcessBus(std::string_view name) const;
+  Json::Node ProcessStop(std::string_view name) const;
+
+  MappedFile file_;
+  const Header* header_;
+  const uint32_t* stop_name_offsets_;
+  const char* stop_name_chars_;
+  const Id* stops_by_name_;
+  const Coords* stop_coords_;
+  const uint32_t* distance_offsets_;
+  const Id* distance_targets_;
+  const int32_t* distance_lengths_;
+  const uint32_t* stop_bus_offsets_;
+  const Id* stop_buses_;
+  const uint32_t* bus_name_offsets_;
+  const char* bus_name_chars_;
+  const Id* buses_by_name_;
+  const uint8_t* bus_looped_;
+  const uint32_t* bus_stop_offsets_;
+  const Id* bus_stops_;
+  const Stats* bus_stats_;
+};
+
+// Lays sections out one after another, each aligned to 8 bytes
+class RouteSnapshot::Builder {
+ public:
+  Builder() : data_(sizeof(Header), '\0') {}
+
+  template <typename T>
+  void Add(Section section, const std::vector<T>& values) {
+    data_.resize((data_.size() + 7) & ~size_t(7), '\0');
+    header_.offsets[section] = data_.size();
+    header_.sizes[section] = values.size() * sizeof(T);
+    data_.append(reinterpret_cast<const char*>(values.data()),
+                 values.size() * sizeof(T));
+  }
+
+  // Adds offsets and characters of names, plus ids sorted by name
+  void AddNames(Section offsets, Section chars, Section by_name,
+                const Interner& names, const std::vector<Id>& ids) {
+    std::vector<uint32_t> name_offsets{0};
+    std::vector<char> name_chars;
+    for (auto id : ids) {
+      auto& name = names.GetName(id);
+      name_chars.insert(name_chars.end(), name.begin(), name.end());
+      name_offsets.push_back(name_chars.size());
+    }
+    std::vector<Id> sorted(ids.size());
+    for (Id i = 0; i < sorted.size(); ++i) sorted[i] = i;
+    std::sort(sorted.begin(), sorted.end(), [&](Id lhs, Id rhs) {
+      return names.GetName(ids[lhs]) < names.GetName(ids[rhs]);
+    });
+    Add(offsets, name_offsets);
+    Add(chars, name_chars);
+    Add(by_name, sorted);
+  }
+
+  void Save(uint32_t stop_count, uint32_t bus_count, const std::string& path) {
+    std::memcpy(header_.magic, kMagic, sizeof(kMagic));
+    header_.version = kVersion;
+    header_.stop_count = stop_count;
+    header_.bus_count = bus_count;
+    header_.file_size = data_.size();
+    std::memcpy(data_.data(), &header_, sizeof(header_));
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(data_.data(), data_.size());
+    if (!out) throw std::runtime_error("Cannot write snapshot " + path);
+  }
+
+ private:
+  Header header_{};
+  std::string data_;
+};
+
+void RouteSnapshot::Write(const StopManager& sm, const BusManager& bm,
+                          const std::string& path) {
+  Builder builder;
+
+  // Stops only mentioned in road_distances are dropped, so ids change
+  std::vector<Id> stop_ids;
+  std::vector<Id> new_stop_id(sm.stops_.size(), UINT32_MAX);
+  for (Id id = 0; id < sm.stops_.size(); ++id) {
+    if (!sm.stops_[id].known) continue;
+    new_stop_id[id] = stop_ids.size();
+    stop_ids.push_back(id);
+  }
+  builder.AddNames(kStopNameOffsets, kStopNameChars, kStopsByName, sm.names_,
+                   stop_ids);
+
+  std::vector<Coords> coords;
+  std::vector<uint32_t> distance_offsets{0}, stop_bus_offsets{0};
+  std::vector<Id> distance_targets, stop_buses;
+  std::vector<int32_t> distance_lengths;
+  for (auto id : stop_ids) {
+    auto& stop = sm.stops_[id];
+    coords.push_back(stop.pos);
+    for (auto i = sm.row_offsets_[id]; i < sm.row_offsets_[id + 1]; ++i) {
+      if (new_stop_id[sm.row_targets_[i]] == UINT32_MAX) continue;
+      distance_targets.push_back(new_stop_id[sm.row_targets_[i]]);
+      distance_lengths.push_back(sm.row_lengths_[i]);
+    }
+    distance_offsets.push_back(distance_targets.size());
+    for (auto bus_name : sm.GetBuses(id))
+      stop_buses.push_back(*bm.names_.Find(bus_name));
+    stop_bus_offsets.push_back(stop_buses.size());
+  }
+  builder.Add(kStopCoords, coords);
+  builder.Add(kDistanceOffsets, distance_offsets);
+  builder.Add(kDistanceTargets, distance_targets);
+  builder.Add(kDistanceLengths, distance_lengths);
+  builder.Add(kStopBusOffsets, stop_bus_offsets);
+  builder.Add(kStopBuses, stop_buses);
+
+  std::vector<Id> bus_ids(bm.buses_.size());
+  for (Id id = 0; id < bus_ids.size(); ++id) bus_ids[id] = id;
+  builder.AddNames(kBusNameOffsets, kBusNameChars, kBusesByName, bm.names_,
+                   bus_ids);
+
+  std::vector<uint8_t> looped;
+  std::vector<uint32_t> bus_stop_offsets{0};
+  std::vector<Id> bus_stops;
+  std::vector<Stats> stats;
+  for (Id id = 0; id < bm.buses_.size(); ++id) {
+    auto& bus = bm.buses_[id];
+    looped.push_back(bus.is_route_looped);
+    for (auto stop : bus.stops) bus_stops.push_back(new_stop_id[stop]);
+    bus_stop_offsets.push_back(bus_stops.size());
+    if (auto& s = bm.stats_[id])
+      stats.push_back({s->stops_n, s->stops_n_unique, s->road_len, 0,
+                       s->geo_len});
+    else
+      stats.push_back({0, 0, 0, 1, 0});
+  }
+  builder.Add(kBusLooped, looped);
+  builder.Add(kBusStopOffsets, bus_stop_offsets);
+  builder.Add(kBusStops, bus_stops);
+  builder.Add(kBusStats, stats);
+
+  builder.Save(stop_ids.size(), bus_ids.size(), path);
+}
+
+RouteSnapshot::RouteSnapshot(const std::string& path) : file_(path) {
+  auto data = file_.Data();
+  header_ = reinterpret_cast<const Header*>(data.data());
+  if (data.size() < sizeof(Header) ||
+      std::memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0)
+    throw std::runtime_error(path + " is not a route snapshot");
+  if (header_->version != kVersion)
+    throw std::runtime_error(path + " has snapshot version " +
+                             std::to_string(header_->version) + ", expected " +
+                             std::to_string(kVersion));
+  if (header_->file_size != data.size())
+    throw std::runtime_error(path + " is truncated");
+
+  size_t stops = header_->stop_count;
+  size_t buses = header_->bus_count;
+  // Queries index the tables without bounds checks, so every offset and id
+  // is checked once here
+  stop_name_offsets_ = GetOffsets(kStopNameOffsets, stops);
+  stop_name_chars_ = Get<char>(kStopNameChars, stop_name_offsets_[stops]);
+  stops_by_name_ = GetIds(kStopsByName, stops, stops);
+  stop_coords_ = Get<Coords>(kStopCoords, stops);
+  distance_offsets_ = GetOffsets(kDistanceOffsets, stops);
+  distance_targets_ =
+      GetIds(kDistanceTargets, distance_offsets_[stops], stops);
+  distance_lengths_ = Get<int32_t>(kDistanceLengths, distance_offsets_[stops]);
+  stop_bus_offsets_ = GetOffsets(kStopBusOffsets, stops);
+  stop_buses_ = GetIds(kStopBuses, stop_bus_offsets_[stops], buses);
+  bus_name_offsets_ = GetOffsets(kBusNameOffsets, buses);
+  bus_name_chars_ = Get<char>(kBusNameChars, bus_name_offsets_[buses]);
+  buses_by_name_ = GetIds(kBusesByName, buses, buses);
+  bus_looped_ = Get<uint8_t>(kBusLooped, buses);
+  bus_stop_offsets_ = GetOffsets(kBusStopOffsets, buses);
+  bus_stops_ = GetIds(kBusStops, bus_stop_offsets_[buses], stops);
+  bus_stats_ = Get<Stats>(kBusStats, buses);
+}
+
+template <typename T>
+const T* RouteSnapshot::Get(Section section, size_t count) const {
+  auto offset = header_->offsets[section];
+  if (header_->sizes[section] != count * sizeof(T) || offset % 8 != 0 ||
+      offset > header_->file_size ||
+      header_->file_size - offset < header_->sizes[section])
+    throw std::runtime_error("Corrupted route snapshot section " +
+                             std::to_string(section));
+  return reinterpret_cast<const T*>(file_.Data().data() + offset);
+}
+
+const uint32_t* RouteSnapshot::GetOffsets(Section section,
+                                          size_t count) const {
+  auto offsets = Get<uint32_t>(section, count + 1);
+  if (offsets[0] != 0 || !std::is_sorted(offsets, offsets + count + 1))
+    throw std::runtime_error("Corrupted route snapshot section " +
+                             std::to_string(section));
+  return offsets;
+}
+
+const RouteSnapshot::Id* RouteSnapshot::GetIds(Section section, size_t count,
+                                               size_t limit) const {
+  auto ids = Get<Id>(section, count);
+  if (std::any_of(ids, ids + count, [limit](Id id) { return id >= limit; }))
+    throw std::runtime_error("Corrupted route snapshot section " +
+                             std::to_string(section));
+  return ids;
+}
+
+std::optional<RouteSnapshot::Id> RouteSnapshot::Find(
+    std::string_view name, const uint32_t* offsets, const char* chars,
+    const Id* by_name, size_t count) const {
+  auto name_of = [&](Id id) {
+    return std::string_view(chars + offsets[id], offsets[id + 1] - offsets[id]);
+  };
+  auto it = std::lower_bound(
+      by_name, by_name + count, name,
+      [&](Id id, std::string_view value) { return name_of(id) < value; });
+  if (it == by_name + count || name_of(*it) != name) return std::nullopt;
+  return *it;
+}
+
+std::optional<RouteSnapshot::Id> RouteSnapshot::FindStop(
+    std::string_view name) const {
+  return Find(name, stop_name_offsets_, stop_name_chars_, stops_by_name_,
+              StopCount());
+}
+
+std::optional<RouteSnapshot::Id> RouteSnapshot::FindBus(
+    std::string_view name) const {
+  return Find(name, bus_name_offsets_, bus_name_chars_, buses_by_name_,
+              BusCount());
+}
+
+std::string_view RouteSnapshot::GetStopName(Id stop) const {
+  return {stop_name_chars_ + stop_name_offsets_[stop],
+          stop_name_offsets_[stop + 1] - stop_name_offsets_[stop]};
+}
+
+std::string_view RouteSnapshot::GetBusName(Id bus) const {
+  return {bus_name_chars_ + bus_name_offsets_[bus],
+          bus_name_offsets_[bus + 1] - bus_name_offsets_[bus]};
+}
+
+std::optional<int> RouteSnapshot::GetRoadDistance(Id from, Id to) const {
+  auto begin = distance_targets_ + distance_offsets_[from];
+  auto end = distance_targets_ + distance_offsets_[from + 1];
+  auto it = std::lower_bound(begin, end, to);
+  if (it == end || *it != to) return std::nullopt;
+  return distance_lengths_[it - distance_targets_];
+}
+
+Json::Span<RouteSnapshot::Id> RouteSnapshot::GetBuses(Id stop) const {
+  return {stop_buses_ + stop_bus_offsets_[stop],
+          stop_bus_offsets_[stop + 1] - stop_bus_offsets_[stop]};
+}
+
+Json::Span<RouteSnapshot::Id> RouteSnapshot::GetStops(Id bus) const {
+  return {bus_stops_ + bus_stop_offsets_[bus],
+          bus_stop_offsets_[bus + 1] - bus_stop_offsets_[bus]};
+}
+
+void RouteSnapshot::ThrowMissingDistance(Id bus) const {
+  auto stops = GetStops(bus);
+  auto check = [this](Id from, Id to) {
+    if (!GetRoadDistance(from, to))
+      throw std::out_of_range("No road distance between " +
+                              std::string(GetStopName(from)) + " and " +
+                              std::string(GetStopName(to)));
+  };
+  for (size_t i = 0; i + 1 < stops.size(); ++i) check(stops[i], stops[i + 1]);
+  if (!IsLooped(bus))
+    for (size_t i = stops.size(); i > 1; --i) check(stops[i - 1], stops[i - 2]);
+  throw std::runtime_error("Corrupted route snapshot: bus " +
+                           std::string(GetBusName(bus)) +
+                           " has no missing distance");
+}
+
+Json::Node RouteSnapshot::ProcessBus(std::string_view name) const {
+  std::string bus_id(name);
+  auto id = FindBus(name);
+  if (!id)
+    return Convert<Json::Node>(
+        BusManager::ProcessResult{false, bus_id, 0, 0, 0, 0});
+
+  auto& stats = bus_stats_[*id];
+  if (stats.missing_distance) ThrowMissingDistance(*id);
+  return Convert<Json::Node>(BusManager::ProcessResult{
+      true, bus_id, stats.stops_n, stats.stops_n_unique, stats.road_len,
+      stats.geo_len});
+}
+
+// Same output as Convert<Json::Node>(StopManager::ProcessResult)
+Json::Node RouteSnapshot::ProcessStop(std::string_view name) const {
+  Json::Node root{std::map<std::string, Json::Node>()};
+  auto id = FindStop(name);
+  if (!id) {
+    root.AsMap()["error_message"] = Json::Node(std::string("not found"));
+    return root;
+  }
+
+  std::vector<Json::Node> buses;
+  buses.reserve(GetBuses(*id).size());
+  for (auto bus : GetBuses(*id))
+    buses.push_back(Json::Node(std::string(GetBusName(bus))));
+  root.AsMap()["buses"] = Json::Node(std::move(buses));
+  return root;
+}
+
+Json::Document RouteSnapshot::Process(const Json::Document& idoc) const {
+  std::vector<Json::Node> output;
+  auto& input_map = idoc.GetRoot().AsMap();
+  if (input_map.find("stat_requests") == input_map.end())
+    return Json::Document({});
+  for (auto& req : input_map.at("stat_requests").AsArray()) {
+    auto& request = req.AsMap();
+    auto& request_type = request.at("type").AsString();
+    Json::Node res;
+    if (request_type == "Bus") {
+      res = ProcessBus(request.at("name").AsString());
+    } else if (request_type == "Stop") {
+      res = ProcessStop(request.at("name").AsString());
+    } else {
+      continue;
+    }
+    res.AsMap()["request_id"] = request.at("id");
+    output.push_back(std::move(res));
+  }
+  return Json::Document(Json::Node(std::move(output)));
+}
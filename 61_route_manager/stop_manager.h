@@ -1,47 +1,226 @@
 #pragma once
 
 #include "common.h"
+#include "interner.h"
 #include "json.h"
 
-#include <set>
-#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
 
 class StopManager {
+  friend class RouteSnapshot;
+
+ public:
+  using StopId = Interner::Id;
+
  private:
   struct Stop {
+    bool known = false;
+    bool defined = false;
+    bool on_route = false;
     Coords pos;
-    std::set<std::string> buses;
-    std::unordered_map<std::string, int> distances;
+    GeoTrig trig;
+  };
+  struct Distance {
+    StopId from;
+    StopId to;
+    int length;
   };
+  using Distances = std::vector<std::pair<StopId, int>>;
 
-  using Stops = std::unordered_map<std::string, Stop>;
-  Stops stops_;
+  Interner names_;
+  std::vector<Stop> stops_;
+  std::vector<StopId> redefined_;
 
-  void Load(const std::string& stop_name, Coords coords,
-            std::unordered_map<std::string, int>& distances);
+  // Distances as given in the input, one per "from -> to" pair
+  std::vector<Distance> declared_;
+  // Reused by the per-request loaders, so parsing a stop does not allocate
+  Distances parsed_;
+  // CSR table built from declared_ with reverse fallbacks filled in:
+  // row i occupies [row_offsets_[i], row_offsets_[i + 1]), sorted by target
+  std::vector<uint32_t> row_offsets_;
+  std::vector<StopId> row_targets_;
+  std::vector<int> row_lengths_;
+  bool distances_dirty_ = false;
+
+  // Bus names of stop i occupy [bus_offsets_[i], bus_offsets_[i + 1]) of
+  // bus_names_, sorted. Pairs added since the last Freeze wait in
+  // new_buses_.
+  std::vector<uint32_t> bus_offsets_{0};
+  std::vector<std::string_view> bus_names_;
+  std::vector<std::pair<StopId, std::string_view>> new_buses_;
+
+  Stop& GetOrAdd(std::string_view stop_name);
+  void FreezeBuses();
+  void Load(std::string_view stop_name, Coords coords, Distances& distances);
 
  public:
+  using Buses = Json::Span<std::string_view>;
+  static constexpr StopId kNoId = UINT32_MAX;
+  // Stop definitions collected by AddToBulk for LoadBulk. Names are interned
+  // as they are added, so a request may be dropped right after it is added.
+  // Road distances of all stops share one vector: those of stops[i] end at
+  // stops[i].distances_end. A stop without a name has id kNoId.
+  struct BulkInput {
+    struct Stop {
+      StopId id;
+      Coords coords;
+      size_t distances_end;
+    };
+    std::vector<Stop> stops;
+    Distances distances;
+  };
   struct ProcessResult {
     bool success;
     const std::string& stop_name;
-    const std::set<std::string>& buses;
+    Buses buses;
   };
   void Load(std::string_view input);
   void Load(const Json::Node& input);
+  // Same as calling Load for each stop in order, but only the latest
+  // definition of a repeated name is applied, old distances are dropped in
+  // one pass and the distance table grows once. Invalid stops are skipped
+  // and their errors returned after everything else is loaded.
+  std::vector<std::string> LoadBulk(const BulkInput& input);
+  void AddToBulk(BulkInput& bulk, const Json::Node& input);
+  void AddToBulk(BulkInput& bulk, const Json::ArenaNode& input);
   ProcessResult Process(const std::string& stop_name) const;
 
-  const Stops& Get() const { return stops_; }
-  void Update(const std::string& bus_id, const std::string& stop_name);
+  StopId Intern(std::string_view stop_name);
+  Coords GetCoords(StopId id) const { return stops_[id].pos; }
+  const GeoTrig& GetTrig(StopId id) const { return stops_[id].trig; }
+  int GetRoadDistance(StopId from, StopId to) const;
+  // Buses through the stop as of the last Freeze, ordered by name
+  Buses GetBuses(StopId id) const {
+    if (id + 1 >= bus_offsets_.size()) return {};
+    return {bus_names_.data() + bus_offsets_[id],
+            bus_offsets_[id + 1] - bus_offsets_[id]};
+  }
+  // bus_name must outlive the manager
+  void Update(std::string_view bus_name, StopId stop_id);
+  // Returns stops already on some route that were loaded since the last call
+  std::vector<StopId> TakeRedefined() { return std::move(redefined_); }
+  // Rebuilds the road distance table and the bus lists if stops or buses
+  // were loaded since the last call
+  void Freeze();
 };
 
-void StopManager::Update(const std::string& bus_id,
-                         const std::string& stop_name) {
-  auto stop_it = stops_.insert({stop_name, Stop()});
-  stop_it.first->second.buses.insert(bus_id);
+StopManager::StopId StopManager::Intern(std::string_view stop_name) {
+  auto id = names_.Intern(stop_name);
+  if (id == stops_.size()) {
+    stops_.emplace_back();
+    distances_dirty_ = true;
+  }
+  return id;
+}
+
+StopManager::Stop& StopManager::GetOrAdd(std::string_view stop_name) {
+  auto& stop = stops_[Intern(stop_name)];
+  stop.known = true;
+  return stop;
+}
+
+int StopManager::GetRoadDistance(StopId from, StopId to) const {
+  auto begin = row_targets_.begin() + row_offsets_[from];
+  auto end = row_targets_.begin() + row_offsets_[from + 1];
+  auto it = std::lower_bound(begin, end, to);
+  if (it == end || *it != to) {
+    std::stringstream error;
+    error << "No road distance between " << names_.GetName(from) << " and "
+          << names_.GetName(to);
+    throw std::out_of_range(error.str());
+  }
+  return row_lengths_[it - row_targets_.begin()];
+}
+
+void StopManager::Freeze() {
+  FreezeBuses();
+  if (!distances_dirty_) return;
+
+  // Reverse edges are only used when the pair is not declared explicitly
+  struct Edge {
+    Distance d;
+    bool reversed;
+  };
+  std::vector<Edge> edges;
+  edges.reserve(2 * declared_.size());
+  for (auto& d : declared_) {
+    edges.push_back({d, false});
+    edges.push_back({{d.to, d.from, d.length}, true});
+  }
+  std::stable_sort(edges.begin(), edges.end(), [](auto& lhs, auto& rhs) {
+    return std::tie(lhs.d.from, lhs.d.to, lhs.reversed) <
+           std::tie(rhs.d.from, rhs.d.to, rhs.reversed);
+  });
+
+  row_offsets_.assign(stops_.size() + 1, 0);
+  row_targets_.clear();
+  row_lengths_.clear();
+  const Edge* prev = nullptr;
+  for (auto& e : edges) {
+    if (prev && prev->d.from == e.d.from && prev->d.to == e.d.to) {
+      // Later declarations of the same pair override earlier ones. prev is
+      // the first edge of the pair, so a reversed prev means the pair has
+      // no explicit declaration and the latest reversed edge wins.
+      if (!e.reversed || prev->reversed) row_lengths_.back() = e.d.length;
+      continue;
+    }
+    ++row_offsets_[e.d.from + 1];
+    row_targets_.push_back(e.d.to);
+    row_lengths_.push_back(e.d.length);
+    prev = &e;
+  }
+  for (size_t i = 1; i < row_offsets_.size(); ++i)
+    row_offsets_[i] += row_offsets_[i - 1];
+  row_targets_.shrink_to_fit();
+  row_lengths_.shrink_to_fit();
+
+  distances_dirty_ = false;
+}
+
+void StopManager::FreezeBuses() {
+  if (new_buses_.empty()) return;
+
+  // Stop ids are dense, so the names are bucketed by stop first and only
+  // the few names of each stop are sorted
+  auto added = std::move(new_buses_);
+  std::vector<uint32_t> offsets(stops_.size() + 1, 0);
+  for (StopId id = 0; id + 1 < bus_offsets_.size(); ++id)
+    offsets[id + 1] = GetBuses(id).size();
+  for (auto& [stop_id, bus_name] : added) ++offsets[stop_id + 1];
+  for (size_t i = 1; i < offsets.size(); ++i) offsets[i] += offsets[i - 1];
+
+  std::vector<std::string_view> names(offsets.back());
+  std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+  for (StopId id = 0; id + 1 < bus_offsets_.size(); ++id)
+    for (auto bus_name : GetBuses(id)) names[next[id]++] = bus_name;
+  for (auto& [stop_id, bus_name] : added) names[next[stop_id]++] = bus_name;
+
+  bus_offsets_.assign(stops_.size() + 1, 0);
+  bus_names_.clear();
+  bus_names_.reserve(names.size());
+  for (StopId id = 0; id < stops_.size(); ++id) {
+    auto begin = names.begin() + offsets[id];
+    auto end = names.begin() + offsets[id + 1];
+    std::sort(begin, end);
+    bus_names_.insert(bus_names_.end(), begin, std::unique(begin, end));
+    bus_offsets_[id + 1] = bus_names_.size();
+  }
+  bus_names_.shrink_to_fit();
 }
 
-void StopManager::Load(const std::string& stop_name, Coords coords,
-                       std::unordered_map<std::string, int>& distances) {
+void StopManager::Update(std::string_view bus_name, StopId stop_id) {
+  auto& stop = stops_[stop_id];
+  stop.known = true;
+  stop.on_route = true;
+  new_buses_.emplace_back(stop_id, bus_name);
+}
+
+void StopManager::Load(std::string_view stop_name, Coords coords,
+                       Distances& distances) {
   if (stop_name.empty()) {
     std::stringstream error;
     error << "Wrong data: Stop name = " << stop_name
@@ -50,47 +229,143 @@ void StopManager::Load(const std::string& stop_name, Coords coords,
     throw std::invalid_argument(error.str());
   }
 
-  auto& stop = stops_[stop_name];
+  auto& stop = GetOrAdd(stop_name);
+  StopId id = &stop - stops_.data();
+  if (stop.defined) {
+    declared_.erase(std::remove_if(declared_.begin(), declared_.end(),
+                                   [id](auto& d) { return d.from == id; }),
+                    declared_.end());
+  }
+  stop.defined = true;
   stop.pos = coords;
-  stop.distances = std::move(distances);
+  stop.trig = ToGeoTrig(coords);
+  for (auto [to, length] : distances) declared_.push_back({id, to, length});
+  distances_dirty_ = true;
+  if (stop.on_route) redefined_.push_back(id);
 }
 
 void StopManager::Load(std::string_view input) {
-  auto stop_name = std::string(RemoveSpaces(ReadToken(input, ":")));
+  auto stop_name = RemoveSpaces(ReadToken(input, ":"));
   auto latitude = Convert<double>(RemoveSpaces(ReadToken(input, ",")));
   auto longitude = Convert<double>(RemoveSpaces(ReadToken(input, ",")));
 
-  std::unordered_map<std::string, int> distances;
+  parsed_.clear();
   while (!input.empty()) {
     auto target_distance = RemoveSpaces(ReadToken(input, ","));
     auto dist = RemoveSpaces(ReadToken(target_distance, "to"));
-    auto target = std::string(RemoveSpaces(target_distance));
-    distances[target] = Convert<int>(RemoveSpaces(ReadToken(dist, "m")));
+    auto target = Intern(RemoveSpaces(target_distance));
+    parsed_.emplace_back(target,
+                         Convert<int>(RemoveSpaces(ReadToken(dist, "m"))));
   }
-  Load(stop_name, {latitude, longitude}, distances);
+  Load(stop_name, {latitude, longitude}, parsed_);
 }
 
 void StopManager::Load(const Json::Node& input) {
   auto& input_map = input.AsMap();
-  auto stop_name = input_map.at("name").AsString();
+  auto& stop_name = input_map.at("name").AsString();
   auto latitude = input_map.at("latitude").AsDouble();
   auto longitude = input_map.at("longitude").AsDouble();
 
-  std::unordered_map<std::string, int> distances;
+  parsed_.clear();
   if (input_map.find("road_distances") != input_map.end())
     for (const auto& [key, value] : input_map.at("road_distances").AsMap())
-      distances[key] = value.AsInt();
+      parsed_.emplace_back(Intern(key), value.AsInt());
+
+  Load(stop_name, {latitude, longitude}, parsed_);
+}
+
+// Distances of a stop without a name are dropped, LoadBulk skips it anyway
+void StopManager::AddToBulk(BulkInput& bulk, const Json::Node& input) {
+  auto& input_map = input.AsMap();
+  auto& name = input_map.at("name").AsString();
+  bulk.stops.push_back({name.empty() ? kNoId : Intern(name),
+                        {input_map.at("latitude").AsDouble(),
+                         input_map.at("longitude").AsDouble()},
+                        0});
+  if (auto it = input_map.find("road_distances");
+      !name.empty() && it != input_map.end())
+    for (const auto& [key, value] : it->second.AsMap())
+      bulk.distances.emplace_back(Intern(key), value.AsInt());
+  bulk.stops.back().distances_end = bulk.distances.size();
+}
+
+void StopManager::AddToBulk(BulkInput& bulk, const Json::ArenaNode& input) {
+  auto name = input.At("name").AsString();
+  bulk.stops.push_back({name.empty() ? kNoId : Intern(name),
+                        {input.At("latitude").AsDouble(),
+                         input.At("longitude").AsDouble()},
+                        0});
+  if (auto road_distances = input.Find("road_distances");
+      !name.empty() && road_distances)
+    for (const auto& [key, value] : road_distances->AsMap())
+      bulk.distances.emplace_back(Intern(key), value.AsInt());
+  bulk.stops.back().distances_end = bulk.distances.size();
+}
+
+std::vector<std::string> StopManager::LoadBulk(const BulkInput& input) {
+  std::vector<std::string> errors;
+  auto& stops = input.stops;
 
-  Load(stop_name, {latitude, longitude}, distances);
+  for (auto& stop : stops) {
+    if (stop.id != kNoId) continue;
+    std::stringstream error;
+    error << "Wrong data: Stop name = ; latitude = " << stop.coords.latitude
+          << "; longitude = " << stop.coords.longitude;
+    errors.push_back(error.str());
+  }
+
+  // Only the latest definition of each stop is applied. Distances of stops
+  // defined by earlier loads are dropped in a single pass.
+  std::vector<uint32_t> latest(stops_.size(), kNoId);
+  bool any_replaced = false;
+  for (size_t i = 0; i < stops.size(); ++i) {
+    if (stops[i].id == kNoId) continue;
+    latest[stops[i].id] = i;
+    any_replaced |= stops_[stops[i].id].defined;
+  }
+  if (any_replaced) {
+    declared_.erase(std::remove_if(declared_.begin(), declared_.end(),
+                                   [&](auto& d) {
+                                     return latest[d.from] != kNoId &&
+                                            stops_[d.from].defined;
+                                   }),
+                    declared_.end());
+  }
+
+  auto distances_begin = [&](size_t i) {
+    return i ? stops[i - 1].distances_end : 0;
+  };
+  size_t distance_count = 0;
+  for (size_t i = 0; i < stops.size(); ++i)
+    if (stops[i].id != kNoId && latest[stops[i].id] == i)
+      distance_count += stops[i].distances_end - distances_begin(i);
+  declared_.reserve(declared_.size() + distance_count);
+
+  for (size_t i = 0; i < stops.size(); ++i) {
+    auto id = stops[i].id;
+    if (id == kNoId || latest[id] != i) continue;
+    auto& stop = stops_[id];
+    stop.known = stop.defined = true;
+    stop.pos = stops[i].coords;
+    stop.trig = ToGeoTrig(stops[i].coords);
+    if (stop.on_route) redefined_.push_back(id);
+
+    for (size_t d = distances_begin(i); d < stops[i].distances_end; ++d) {
+      auto [to, length] = input.distances[d];
+      declared_.push_back({id, to, length});
+    }
+  }
+  distances_dirty_ = true;
+  return errors;
 }
 
 StopManager::ProcessResult StopManager::Process(
     const std::string& stop_name) const {
-  auto stop_it = stops_.find(stop_name);
-  if (stop_it == stops_.end())
+  auto id = names_.Find(stop_name);
+  if (!id || !stops_[*id].known)
     return {.success = false, .stop_name = stop_name, .buses = {}};
 
-  return {.success = true, .stop_name = stop_name, stop_it->second.buses};
+  return {.success = true, .stop_name = stop_name, GetBuses(*id)};
 }
 
 template <class T>
@@ -118,7 +393,7 @@ Json::Node Convert<Json::Node>(const StopManager::ProcessResult& res) {
     root.AsMap()["buses"] = Json::Node(std::vector<Json::Node>());
     auto& buses = root.AsMap()["buses"].AsArray();
     buses.reserve(res.buses.size());
-    for (auto& bus : res.buses) buses.push_back(Json::Node(bus));
+    for (auto& bus : res.buses) buses.push_back(Json::Node(std::string(bus)));
   } else {
     root.AsMap()["error_message"] = Json::Node(std::string("not found"));
   }
@@ -0,0 +1,828 @@
+#include "json.h"
+#include "route_manager.h"
+#include "route_service.h"
+
+#include "../profile.h"
+#include "../test_runner.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+const string kSmallInput = R"({
+  "base_requests": [
+    {"type": "Stop", "road_distances": {"Marushkino": 3900}, "longitude": 37.20829, "name": "Tolstopaltsevo", "latitude": 55.611087},
+    {"type": "Stop", "road_distances": {"Rasskazovka": 9900}, "longitude": 37.209755, "name": "Marushkino", "latitude": 55.595884},
+    {"type": "Bus", "name": "256", "stops": ["Biryulyovo Zapadnoye", "Biryusinka", "Universam", "Biryulyovo Tovarnaya", "Biryulyovo Passazhirskaya", "Biryulyovo Zapadnoye"], "is_roundtrip": true},
+    {"type": "Bus", "name": "750", "stops": ["Tolstopaltsevo", "Marushkino", "Rasskazovka"], "is_roundtrip": false},
+    {"type": "Stop", "road_distances": {}, "longitude": 37.333324, "name": "Rasskazovka", "latitude": 55.632761},
+    {"type": "Stop", "road_distances": {"Rossoshanskaya ulitsa": 7500, "Biryusinka": 1800, "Universam": 2400}, "longitude": 37.6517, "name": "Biryulyovo Zapadnoye", "latitude": 55.574371},
+    {"type": "Stop", "road_distances": {"Universam": 750}, "longitude": 37.64839, "name": "Biryusinka", "latitude": 55.581065},
+    {"type": "Stop", "road_distances": {"Rossoshanskaya ulitsa": 5600, "Biryulyovo Tovarnaya": 900}, "longitude": 37.645687, "name": "Universam", "latitude": 55.587655},
+    {"type": "Stop", "road_distances": {"Biryulyovo Passazhirskaya": 1300}, "longitude": 37.653656, "name": "Biryulyovo Tovarnaya", "latitude": 55.592028},
+    {"type": "Stop", "road_distances": {"Biryulyovo Zapadnoye": 1200}, "longitude": 37.659164, "name": "Biryulyovo Passazhirskaya", "latitude": 55.580999},
+    {"type": "Bus", "name": "828", "stops": ["Biryulyovo Zapadnoye", "Universam", "Rossoshanskaya ulitsa", "Biryulyovo Zapadnoye"], "is_roundtrip": true},
+    {"type": "Stop", "road_distances": {}, "longitude": 37.605757, "name": "Rossoshanskaya ulitsa", "latitude": 55.595579},
+    {"type": "Stop", "road_distances": {}, "longitude": 37.603831, "name": "Prazhskaya", "latitude": 55.611678}
+  ],
+  "stat_requests": [
+    {"type": "Bus", "name": "256", "id": 1965312327},
+    {"type": "Bus", "name": "750", "id": 519139350},
+    {"type": "Bus", "name": "751", "id": 194217464},
+    {"type": "Stop", "name": "Samara", "id": 746888088},
+    {"type": "Stop", "name": "Prazhskaya", "id": 65100610},
+    {"type": "Stop", "name": "Biryulyovo Zapadnoye", "id": 1042838872}
+  ]
+})";
+
+const string kSmallOutput =
+    R"([{"curvature":1.36124,"request_id":1965312327,"route_length":5950,)"
+    R"("stop_count":6,"unique_stop_count":5},{"curvature":1.31808,)"
+    R"("request_id":519139350,"route_length":27600,"stop_count":5,)"
+    R"("unique_stop_count":3},{"error_message":"not found",)"
+    R"("request_id":194217464},{"error_message":"not found",)"
+    R"("request_id":746888088},{"buses":[],"request_id":65100610},)"
+    R"({"buses":["256","828"],"request_id":1042838872}])";
+
+// Stops lie on a ring with distances to the next three stops, every bus
+// rides route_len consecutive stops of the ring
+string MakeInput(int stop_count, int bus_count, int route_len,
+                 int request_count) {
+  ostringstream os;
+  auto stop_name = [stop_count](int i) {
+    return "\"Stop " + to_string(i % stop_count) + "\"";
+  };
+
+  os << "{\"base_requests\": [";
+  for (int i = 0; i < stop_count; ++i) {
+    os << "{\"type\": \"Stop\", \"name\": " << stop_name(i)
+       << ", \"latitude\": 55." << 100000 + i % 800000
+       << ", \"longitude\": 37." << 100000 + i * 7 % 800000
+       << ", \"road_distances\": {";
+    for (int k = 1; k <= 3; ++k)
+      os << (k > 1 ? ", " : "") << stop_name(i + k) << ": "
+         << 100 + (i * k) % 4900;
+    os << "}}, ";
+  }
+  for (int b = 0; b < bus_count; ++b) {
+    os << "{\"type\": \"Bus\", \"name\": \"Bus " << b << "\", \"stops\": [";
+    int first = b * 37 % stop_count;
+    for (int k = 0; k < route_len; ++k)
+      os << (k > 0 ? ", " : "") << stop_name(first + k);
+    os << "], \"is_roundtrip\": false}" << (b + 1 < bus_count ? ", " : "");
+  }
+  os << "], \"stat_requests\": [";
+  for (int i = 0; i < request_count; ++i) {
+    os << (i > 0 ? ", " : "") << "{\"type\": ";
+    if (i % 2)
+      os << "\"Bus\", \"name\": \"Bus " << i % (bus_count + 10) << "\"";
+    else
+      os << "\"Stop\", \"name\": " << stop_name(i);
+    os << ", \"id\": " << i << "}";
+  }
+  os << "]}";
+  return os.str();
+}
+
+// Text format counterpart of MakeInput
+string MakeTextInput(int stop_count, int bus_count, int route_len,
+                     int request_count) {
+  ostringstream os;
+  auto stop_name = [stop_count](int i) {
+    return "Stop " + to_string(i % stop_count);
+  };
+
+  os << stop_count + bus_count << "\n";
+  for (int i = 0; i < stop_count; ++i) {
+    os << "Stop " << stop_name(i) << ": 55." << 100000 + i % 800000
+       << ", 37." << 100000 + i * 7 % 800000;
+    for (int k = 1; k <= 3; ++k)
+      os << ", " << 100 + (i * k) % 4900 << "m to " << stop_name(i + k);
+    os << "\n";
+  }
+  for (int b = 0; b < bus_count; ++b) {
+    os << "Bus Bus " << b << ": ";
+    int first = b * 37 % stop_count;
+    for (int k = 0; k < route_len; ++k)
+      os << (k > 0 ? " - " : "") << stop_name(first + k);
+    os << "\n";
+  }
+  os << request_count << "\n";
+  for (int i = 0; i < request_count; ++i) {
+    if (i % 2)
+      os << "Bus Bus " << i % (bus_count + 10) << "\n";
+    else
+      os << "Stop " << stop_name(i) << "\n";
+  }
+  return os.str();
+}
+
+vector<string> ProcessTextStream(const string& input) {
+  istringstream is(input);
+  return RouteManager().Process(is);
+}
+
+vector<string> ProcessTextBuffer(const string& input) {
+  RouteManager rm;
+  return rm.ProcessText(rm.LoadText(input));
+}
+
+string ProcessTree(const string& input) {
+  istringstream is(input);
+  auto doc = Json::Load(is);
+  RouteManager rm;
+  rm.Load(doc);
+  ostringstream os;
+  os << rm.Process(doc);
+  return os.str();
+}
+
+string ProcessStream(const string& input) {
+  istringstream is(input);
+  RouteManager rm;
+  auto doc = rm.LoadJson(is);
+  ostringstream os;
+  os << rm.Process(doc);
+  return os.str();
+}
+
+string ProcessArena(const string& input) {
+  auto doc = Json::LoadArenaFromBuffer(input);
+  RouteManager rm;
+  rm.Load(doc);
+  ostringstream os;
+  os << rm.Process(doc);
+  return os.str();
+}
+
+string ProcessParallel(const string& input, size_t thread_count) {
+  auto doc = Json::LoadFromBuffer(input);
+  RouteManager rm(doc);
+  ostringstream os;
+  os << rm.Process(doc, thread_count);
+  return os.str();
+}
+
+void TestTreeLoad() { ASSERT_EQUAL(ProcessTree(kSmallInput), kSmallOutput); }
+
+void TestStreamLoad() {
+  ASSERT_EQUAL(ProcessStream(kSmallInput), kSmallOutput);
+  ASSERT_EQUAL(ProcessStream(R"({"stat_requests": []})"), "[]");
+}
+
+void TestNodeBuilder() {
+  const string input =
+      R"({"a": [1, 2.5, {"b": true}, []], "c": {}, "d": "text"})";
+  istringstream tree_is(input);
+  istringstream stream_is(input);
+  Json::NodeBuilder builder;
+  Json::Parse(stream_is, builder);
+  ASSERT(builder.HasResult());
+  ASSERT_EQUAL(builder.TakeResult().ToString(),
+               Json::Load(tree_is).GetRoot().ToString());
+  ASSERT(!builder.HasResult());
+}
+
+void TestLoadFromBuffer() {
+  istringstream is(kSmallInput);
+  auto expected = Json::Load(is).GetRoot().ToString();
+  ASSERT_EQUAL(Json::LoadFromBuffer(kSmallInput).GetRoot().ToString(),
+               expected);
+
+  const auto path = filesystem::temp_directory_path() / "route_manager.json";
+  ofstream(path) << kSmallInput;
+  ASSERT_EQUAL(Json::LoadFromFile(path).GetRoot().ToString(), expected);
+  filesystem::remove(path);
+
+  auto numbers = Json::LoadFromBuffer("[0, -12, 3.25, -0.5, 1e3, true]");
+  ASSERT_EQUAL(numbers.GetRoot().ToString(), "[0,-12,3.25,-0.5,1000,true]");
+}
+
+vector<uint32_t> ScanStructureNaive(string_view input) {
+  vector<uint32_t> result;
+  bool in_string = false;
+  for (size_t i = 0; i < input.size(); ++i) {
+    char c = input[i];
+    if (c == '"') in_string = !in_string;
+    if (c == '"' || (!in_string && string_view("{}[]:,").find(c) !=
+                                       string_view::npos))
+      result.push_back(i);
+  }
+  return result;
+}
+
+void TestScanStructure() {
+  ASSERT_EQUAL(Json::ScanStructure(""), vector<uint32_t>());
+  ASSERT_EQUAL(Json::ScanStructure(R"({"a,b": [1, {}]})"),
+               (vector<uint32_t>{0, 1, 5, 6, 8, 10, 12, 13, 14, 15}));
+
+  // Strings full of structural chars crossing 64-byte block borders
+  string input = "[";
+  for (int i = 0; i < 300; ++i) {
+    input += "\"" + string(i % 70, i % 2 ? ',' : '{') + "\", ";
+    input += to_string(i) + (i % 3 ? ", " : ",\n");
+  }
+  input += "true]";
+  for (size_t len = 0; len <= input.size(); len += 7) {
+    auto prefix = string_view(input).substr(0, len);
+    ASSERT_EQUAL(Json::ScanStructure(prefix), ScanStructureNaive(prefix));
+  }
+  ASSERT_EQUAL(Json::LoadFromBuffer(input).GetRoot().AsArray().size(), 601u);
+}
+
+void TestArenaLoad() {
+  ASSERT_EQUAL(ProcessArena(kSmallInput), kSmallOutput);
+
+  const string input =
+      R"({"b": [1, 2.5, {"z": true, "a": []}, "text"], "a": {}, "b": 0})";
+  auto doc = Json::LoadArenaFromBuffer(input);
+  ASSERT_EQUAL(doc.GetRoot().ToNode().ToString(),
+               Json::LoadFromBuffer(input).GetRoot().ToString());
+  ASSERT_EQUAL(doc.GetRoot().AsMap().size(), 2u);
+  ASSERT_EQUAL(doc.GetRoot().At("b").AsArray()[3].AsString(), "text");
+  ASSERT(doc.GetRoot().Find("c") == nullptr);
+  ASSERT_EQUAL(doc.GetRoot().At("b").AsArray()[2].At("z").AsBoolean(), true);
+}
+
+void TestLoadTruncated() {
+  for (string_view text : {"", " ", "[", "{", " [ ", "[1", "[1,", "{\"a\":",
+                           "{\"a\": 1", "[\"abc"}) {
+    // No terminating zero after the input, like a mapped file
+    vector<char> buffer(text.begin(), text.end());
+    string_view input(buffer.data(), buffer.size());
+    for (bool arena : {false, true}) {
+      try {
+        if (arena) {
+          Json::LoadArenaFromBuffer(input);
+        } else {
+          Json::LoadFromBuffer(input);
+        }
+        ASSERT(false);
+      } catch (invalid_argument&) {
+      }
+    }
+  }
+}
+
+void TestParallelProcess() {
+  for (size_t thread_count : {0, 1, 2, 5, 64})
+    ASSERT_EQUAL(ProcessParallel(kSmallInput, thread_count), kSmallOutput);
+  ASSERT_EQUAL(ProcessParallel(R"({"stat_requests": []})", 4), "[]");
+
+  const string input = MakeInput(1'000, 100, 20, 1'000);
+  ASSERT_EQUAL(ProcessParallel(input, 7), ProcessTree(input));
+
+  // One manager keeps its worker pool between calls and grows it on demand
+  auto doc = Json::LoadFromBuffer(input);
+  RouteManager rm(doc);
+  for (size_t thread_count : {2, 2, 4, 3, 8, 1}) {
+    ostringstream os;
+    os << rm.Process(doc, thread_count);
+    ASSERT_EQUAL(os.str(), ProcessTree(input));
+  }
+
+  // Errors of worker threads reach the caller
+  string missing = R"({"base_requests": [)"
+      R"({"type": "Stop", "name": "A", "latitude": 55.6, "longitude": 37.2},)"
+      R"({"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.2},)"
+      R"({"type": "Bus", "name": "X", "stops": ["A", "B"],)"
+      R"( "is_roundtrip": true}], "stat_requests": [)";
+  for (int i = 0; i < 1'000; ++i)
+    missing += (i ? ", " : "") + R"({"type": "Bus", "name": "X", "id": )"s +
+               to_string(i) + "}";
+  missing += "]}";
+  try {
+    ProcessParallel(missing, 4);
+    ASSERT(false);
+  } catch (out_of_range&) {
+  }
+}
+
+vector<Coords> MakeRoute(int size) {
+  vector<Coords> route;
+  for (int i = 0; i < size; ++i)
+    route.push_back({55.5 + (i * 7919LL % 1000) * 1e-4,
+                     37.4 + (i * 104729LL % 1000) * 2e-4});
+  return route;
+}
+
+void TestGeoLengths() {
+  auto coords = MakeRoute(1'000);
+  coords.push_back(coords.back());
+  coords.push_back({-33.86, 151.2});
+  GeoRoute route;
+  for (auto c : coords) route.Add(ToGeoTrig(c));
+  vector<double> lengths;
+  CalculateGeoLengths(route, lengths);
+  ASSERT_EQUAL(lengths.size(), coords.size() - 1);
+  for (size_t i = 0; i + 1 < coords.size(); ++i) {
+    double expected = CalculateGeoLength(coords[i], coords[i + 1]);
+    ASSERT(abs(lengths[i] - expected) <= 1e-9 * abs(expected) + 1e-6);
+  }
+
+  CalculateGeoLengths(GeoRoute(), lengths);
+  ASSERT(lengths.empty());
+}
+
+void TestLoadText() {
+  const string input =
+      "3\n"
+      "Stop Tolstopaltsevo: 55.611087, 37.20829, 3900m to Marushkino\n"
+      "Stop Marushkino: 55.595884, 37.209755\n"
+      "Bus 750: Tolstopaltsevo - Marushkino\n"
+      "2\n"
+      "Bus 750\n"
+      "Stop Marushkino\n";
+  RouteManager rm;
+  auto rest = rm.LoadText(input);
+  ASSERT_EQUAL(rest, "2\nBus 750\nStop Marushkino\n");
+  istringstream requests(
+      R"({"stat_requests": [{"type": "Bus", "name": "750", "id": 1},)"
+      R"({"type": "Stop", "name": "Marushkino", "id": 2}]})");
+  ostringstream os;
+  os << rm.Process(Json::Load(requests));
+  ASSERT_EQUAL(os.str(),
+               R"([{"curvature":2.3036,"request_id":1,"route_length":7800,)"
+               R"("stop_count":3,"unique_stop_count":2},)"
+               R"({"buses":["750"],"request_id":2}])");
+
+  ASSERT_EQUAL(ProcessTextStream(input),
+               (vector<string>{"Bus 750: 3 stops on route, 2 unique stops, "
+                               "7800 route length, 2.303604 curvature",
+                               "Stop Marushkino: buses 750"}));
+
+  const string generated = MakeTextInput(1'000, 100, 20, 1'000);
+  ASSERT_EQUAL(ProcessTextBuffer(generated), ProcessTextStream(generated));
+
+  ASSERT_EQUAL(RouteManager().LoadText("1\nStop A: 1, 2\r\nrest"), "rest");
+  ASSERT_EQUAL(RouteManager().LoadText(""), "");
+}
+
+void TestStopBuses() {
+  RouteManager rm;
+  rm.LoadText(
+      "3\nStop A: 55.6, 37.2, 1000m to B\nStop B: 55.61, 37.21\n"
+      "Bus 2: A - B\n");
+  rm.LoadText(
+      "3\nBus 1: B - A\nBus 10: A > B > A\n"
+      "Stop A: 55.6, 37.2, 2000m to B\n");
+
+  istringstream requests(
+      R"({"stat_requests": [{"type": "Stop", "name": "A", "id": 1},)"
+      R"({"type": "Stop", "name": "B", "id": 2},)"
+      R"({"type": "Bus", "name": "2", "id": 3}]})");
+  auto result = rm.Process(Json::Load(requests));
+  auto& responses = result.GetRoot().AsArray();
+  ASSERT_EQUAL(Json::Node(responses[0].AsMap().at("buses")).ToString(),
+               R"(["1","10","2"])");
+  ASSERT_EQUAL(Json::Node(responses[1].AsMap().at("buses")).ToString(),
+               R"(["1","10","2"])");
+  ASSERT_EQUAL(responses[2].AsMap().at("route_length").AsInt(), 4000);
+}
+
+void TestDuplicateDistance() {
+  RouteManager rm;
+  rm.LoadText(
+      "3\nStop A: 55.6, 37.2, 100m to B, 200m to B\n"
+      "Stop B: 55.61, 37.2\nBus X: A - B\n");
+  istringstream requests(
+      R"({"stat_requests": [{"type": "Bus", "name": "X", "id": 1}]})");
+  auto result = rm.Process(Json::Load(requests));
+  ASSERT_EQUAL(
+      result.GetRoot().AsArray()[0].AsMap().at("route_length").AsInt(), 400);
+}
+
+void TestBulkStopLoad() {
+  const string base = R"({"base_requests": [)"
+      R"({"type": "Stop", "name": "A", "latitude": 55.6, "longitude": 37.2,)"
+      R"( "road_distances": {"B": 100}},)"
+      R"({"type": "Bus", "name": "X", "stops": ["A", "B"],)"
+      R"( "is_roundtrip": false},)"
+      R"({"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.2,)"
+      R"( "road_distances": {"A": 200}},)"
+      R"({"type": "Stop", "name": "A", "latitude": 55.6, "longitude": 37.2,)"
+      R"( "road_distances": {"B": 300}})";
+  const string requests = R"(], "stat_requests": [)"
+      R"({"type": "Bus", "name": "X", "id": 1},)"
+      R"({"type": "Stop", "name": "B", "id": 2}]})";
+  const string input = base + requests;
+  ASSERT_EQUAL(ProcessTree(input), ProcessStream(input));
+  ASSERT_EQUAL(ProcessArena(input), ProcessStream(input));
+
+  auto doc = Json::LoadFromBuffer(
+      base + R"(, {"type": "Stop", "name": "", "latitude": 1,)"
+             R"( "longitude": 2, "road_distances": {}})" + requests);
+  RouteManager rm;
+  try {
+    rm.Load(doc);
+    ASSERT(false);
+  } catch (invalid_argument& e) {
+    ASSERT_EQUAL(string(e.what()),
+                 "Wrong data: Stop name = ; latitude = 1; longitude = 2");
+  }
+  auto result = rm.Process(doc);
+  ASSERT_EQUAL(
+      result.GetRoot().AsArray()[0].AsMap().at("route_length").AsInt(), 500);
+}
+
+// An invalid stop is skipped, the requests after it are still loaded and
+// the error is thrown at the end
+void TestStopErrorsAfterLoad() {
+  const string input = R"({"base_requests": [)"
+      R"({"type": "Stop", "name": "", "latitude": 1, "longitude": 2},)"
+      R"({"type": "Stop", "name": "A", "latitude": 55.6, "longitude": 37.2,)"
+      R"( "road_distances": {"B": 100}},)"
+      R"({"type": "Bus", "name": "X", "stops": ["A", "B"],)"
+      R"( "is_roundtrip": false},)"
+      R"({"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.2}],)"
+      R"( "stat_requests": [{"type": "Bus", "name": "X", "id": 1}]})";
+  const string error = "Wrong data: Stop name = ; latitude = 1; longitude = 2";
+
+  auto check = [&](auto load) {
+    RouteManager rm;
+    try {
+      load(rm);
+      ASSERT(false);
+    } catch (invalid_argument& e) {
+      ASSERT_EQUAL(string(e.what()), error);
+    }
+    auto result = rm.ProcessFrozen(Json::LoadFromBuffer(input));
+    ASSERT_EQUAL(
+        result.GetRoot().AsArray()[0].AsMap().at("route_length").AsInt(), 200);
+  };
+  check([&](RouteManager& rm) { rm.Load(Json::LoadFromBuffer(input)); });
+  check([&](RouteManager& rm) { rm.Load(Json::LoadArenaFromBuffer(input)); });
+  check([&](RouteManager& rm) {
+    istringstream is(input);
+    rm.LoadJson(is);
+  });
+}
+
+// Bus Y has no road distance between A and C. Loading must not fail on it,
+// only a request for Y does, as with stats computed on demand
+void TestMissingDistance() {
+  const string base = R"({"base_requests": [)"
+      R"({"type": "Stop", "name": "A", "latitude": 55.6, "longitude": 37.2,)"
+      R"( "road_distances": {"B": 100}},)"
+      R"({"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.2},)"
+      R"({"type": "Stop", "name": "C", "latitude": 55.62, "longitude": 37.2},)"
+      R"({"type": "Bus", "name": "X", "stops": ["A", "B"],)"
+      R"( "is_roundtrip": false},)"
+      R"({"type": "Bus", "name": "Y", "stops": ["A", "C"],)"
+      R"( "is_roundtrip": false}], "stat_requests": [)";
+  const string input = base + R"({"type": "Bus", "name": "X", "id": 1}]})";
+  const string expected =
+      R"([{"curvature":0.0899322,"request_id":1,"route_length":200,)"
+      R"("stop_count":3,"unique_stop_count":2}])";
+  ASSERT_EQUAL(ProcessTree(input), expected);
+  ASSERT_EQUAL(ProcessArena(input), expected);
+  ASSERT_EQUAL(ProcessStream(input), expected);
+  ASSERT_EQUAL(ProcessParallel(input, 2), expected);
+
+  const auto query_y =
+      Json::LoadFromBuffer(base + R"({"type": "Bus", "name": "Y", "id": 2}]})");
+  const string error = "No road distance between A and C";
+  RouteManager rm(Json::LoadFromBuffer(input));
+  try {
+    rm.ProcessFrozen(query_y);
+    ASSERT(false);
+  } catch (out_of_range& e) {
+    ASSERT_EQUAL(string(e.what()), error);
+  }
+
+  const auto path = filesystem::temp_directory_path() / "route_manager.snap";
+  rm.SaveSnapshot(path);
+  RouteSnapshot snapshot(path);
+  ostringstream os;
+  os << snapshot.Process(Json::LoadFromBuffer(input));
+  ASSERT_EQUAL(os.str(), expected);
+  try {
+    snapshot.Process(query_y);
+    ASSERT(false);
+  } catch (out_of_range& e) {
+    ASSERT_EQUAL(string(e.what()), error);
+  }
+  filesystem::remove(path);
+}
+
+void TestSnapshot() {
+  const auto path = filesystem::temp_directory_path() / "route_manager.snap";
+  {
+    RouteManager rm;
+    rm.Load(Json::LoadFromBuffer(kSmallInput));
+    rm.SaveSnapshot(path);
+  }
+  RouteSnapshot snapshot(path);
+  ostringstream os;
+  os << snapshot.Process(Json::LoadFromBuffer(kSmallInput));
+  ASSERT_EQUAL(os.str(), kSmallOutput);
+
+  auto from = snapshot.FindStop("Biryulyovo Zapadnoye");
+  auto to = snapshot.FindStop("Universam");
+  ASSERT(from && to);
+  ASSERT_EQUAL(snapshot.GetStopName(*from), "Biryulyovo Zapadnoye");
+  ASSERT_EQUAL(snapshot.GetCoords(*from).latitude, 55.574371);
+  ASSERT_EQUAL(snapshot.GetRoadDistance(*from, *to).value(), 2400);
+  ASSERT_EQUAL(snapshot.GetRoadDistance(*to, *from).value(), 2400);
+  ASSERT(!snapshot.GetRoadDistance(*from, *from));
+  auto bus = snapshot.FindBus("750");
+  ASSERT(bus && !snapshot.IsLooped(*bus));
+  ASSERT_EQUAL(snapshot.GetStops(*bus).size(), 3u);
+  ASSERT_EQUAL(snapshot.GetStopName(snapshot.GetStops(*bus)[1]), "Marushkino");
+  ASSERT(!snapshot.FindBus("751"));
+
+  const string input = MakeInput(1'000, 100, 20, 1'000);
+  {
+    RouteManager rm;
+    rm.Load(Json::LoadFromBuffer(input));
+    rm.SaveSnapshot(path);
+  }
+  ostringstream snapshot_os;
+  snapshot_os << RouteSnapshot(path).Process(Json::LoadFromBuffer(input));
+  ASSERT_EQUAL(snapshot_os.str(), ProcessTree(input));
+
+  // ASSERT throws runtime_error too, so it cannot go inside the try
+  auto rejected = [&path](const string& data) {
+    ofstream(path, ios::binary) << data;
+    try {
+      RouteSnapshot broken(path);
+    } catch (runtime_error&) {
+      return true;
+    }
+    return false;
+  };
+  // Overwrites one uint32_t of a section; section offsets start at byte 32
+  // of the header
+  const string saved = (ostringstream() << ifstream(path, ios::binary).rdbuf())
+                           .str();
+  auto corrupt = [&saved](size_t section, size_t index, uint32_t value) {
+    string data = saved;
+    uint64_t offset;
+    memcpy(&offset, data.data() + 32 + section * 8, sizeof(offset));
+    memcpy(data.data() + offset + index * 4, &value, sizeof(value));
+    return data;
+  };
+  ASSERT(!rejected(saved));
+  ASSERT(rejected(corrupt(2, 0, 1'000)));  // stops_by_name
+  ASSERT(rejected(corrupt(4, 1, UINT32_MAX)));  // distance_offsets
+  ASSERT(rejected(corrupt(5, 0, 1'000)));  // distance_targets
+  ASSERT(rejected(corrupt(8, 0, 100)));  // stop_buses
+  ASSERT(rejected(corrupt(14, 0, UINT32_MAX)));  // bus_stops
+  ASSERT(rejected("RTESNAP"));
+  filesystem::remove(path);
+}
+
+void TestRouteService() {
+  RouteService service;
+  ASSERT_EQUAL(service.GetVersion(), 0u);
+  ostringstream empty;
+  empty << service.Process(Json::LoadFromBuffer(kSmallInput));
+  ASSERT_EQUAL(empty.str(), R"([{"error_message":"not found","request_id":)"
+                            R"(1965312327},{"error_message":"not found",)"
+                            R"("request_id":519139350},{"error_message":)"
+                            R"("not found","request_id":194217464},)"
+                            R"({"error_message":"not found","request_id":)"
+                            R"(746888088},{"error_message":"not found",)"
+                            R"("request_id":65100610},{"error_message":)"
+                            R"("not found","request_id":1042838872}])");
+
+  ASSERT_EQUAL(service.Reload(Json::LoadFromBuffer(kSmallInput)), 1u);
+  ostringstream loaded;
+  loaded << service.Process(Json::LoadFromBuffer(kSmallInput));
+  ASSERT_EQUAL(loaded.str(), kSmallOutput);
+
+  // Services share the per-thread cache of the last read base, a service
+  // created where a destroyed one was must not get its base
+  shared_ptr<const RouteService::Base> destroyed;
+  for (int i = 0; i < 2; ++i) {
+    auto other = make_unique<RouteService>();
+    auto base = other->GetBase();
+    ASSERT(base != destroyed);
+    ASSERT_EQUAL(service.GetVersion(), 1u);
+    ASSERT(other->GetBase() == base);
+    destroyed = base;
+  }
+}
+
+// Readers query one bus many times per request while bases whose routes
+// differ in length are swapped in. Every response must come from a single
+// base and versions must never go back.
+void TestRouteServiceStress() {
+  vector<Json::Document> bases;
+  for (int route_len : {5, 10})
+    bases.push_back(Json::LoadFromBuffer(MakeInput(200, 20, route_len, 0)));
+  string requests = R"({"stat_requests": [)";
+  for (int i = 0; i < 50; ++i)
+    requests += (i ? ", " : "") + R"({"type": "Bus", "name": "Bus 3", "id": )"s +
+                to_string(i) + "}";
+  const auto queries = Json::LoadFromBuffer(requests + "]}");
+
+  RouteService service;
+  service.Reload(bases[0]);
+  atomic<bool> done = false;
+  auto reader = [&] {
+    size_t reads = 0;
+    uint64_t last_version = 0;
+    while (!done || reads == 0) {
+      auto version = service.GetVersion();
+      ASSERT(version >= last_version);
+      last_version = version;
+
+      auto result = service.Process(queries);
+      auto& responses = result.GetRoot().AsArray();
+      ASSERT_EQUAL(responses.size(), 50u);
+      int stops = responses.front().AsMap().at("stop_count").AsInt();
+      ASSERT(stops == 9 || stops == 19);
+      for (auto& response : responses)
+        ASSERT_EQUAL(response.AsMap().at("stop_count").AsInt(), stops);
+      ++reads;
+    }
+    return reads;
+  };
+
+  vector<future<size_t>> readers;
+  for (int i = 0; i < 4; ++i) readers.push_back(async(launch::async, reader));
+  for (int i = 1; i <= 20; ++i)
+    ASSERT_EQUAL(service.ReloadAsync(bases[i % 2]).get(), i + 1u);
+  done = true;
+  for (auto& r : readers) ASSERT(r.get() > 0);
+  ASSERT_EQUAL(service.GetVersion(), 21u);
+}
+
+void TestWriter() {
+  Json::Node node(map<string, Json::Node>{
+      {"text", Json::Node("a\"b\\c\nd\x01"s)},
+      {"numbers", Json::Node(vector<Json::Node>{Json::Node(-7), Json::Node(0.1),
+                                                Json::Node(1.0 / 3),
+                                                Json::Node(1e21)})},
+      {"empty", Json::Node(vector<Json::Node>())},
+      {"flag", Json::Node(false)}});
+  const string expected =
+      R"({"empty":[],"flag":false,"numbers":[-7,0.1,0.333333,1e+21],)"
+      R"("text":"a\"b\\c\nd\u0001"})";
+  ASSERT_EQUAL(node.ToString(), expected);
+
+  ostringstream os;
+  {
+    Json::Writer writer(os);
+    for (int i = 0; i < 10'000; ++i) writer.Write(node);
+  }
+  ASSERT_EQUAL(os.str().size(), 10'000 * expected.size());
+  ASSERT_EQUAL(os.str().substr(0, expected.size()), expected);
+}
+
+template <typename Func>
+void LogThroughput(const string& name, size_t bytes, Func func) {
+  auto start = chrono::steady_clock::now();
+  func();
+  chrono::duration<double> seconds = chrono::steady_clock::now() - start;
+  cerr << name << ": " << bytes / seconds.count() / (1 << 20) << " MB/s\n";
+}
+
+void BenchmarkLoad() {
+  const string input = MakeInput(50'000, 5'000, 50, 10'000);
+  string tree_output, stream_output;
+  {
+    LOG_DURATION("Tree load");
+    tree_output = ProcessTree(input);
+  }
+  {
+    LOG_DURATION("Stream load");
+    stream_output = ProcessStream(input);
+  }
+  ASSERT_EQUAL(tree_output, stream_output);
+  {
+    LOG_DURATION("Arena load");
+    ASSERT_EQUAL(ProcessArena(input), tree_output);
+  }
+  LogThroughput("Parse from stream", input.size(), [&input] {
+    istringstream is(input);
+    Json::Load(is);
+  });
+  LogThroughput("Scan structure", input.size(),
+                [&input] { Json::ScanStructure(input); });
+  LogThroughput("Parse from buffer", input.size(),
+                [&input] { Json::LoadFromBuffer(input); });
+  LogThroughput("Parse into arena", input.size(),
+                [&input] { Json::LoadArenaFromBuffer(input); });
+
+  auto doc = Json::LoadFromBuffer(input);
+  LogThroughput("Write", input.size(), [&doc] {
+    ostringstream os;
+    os << doc;
+  });
+}
+
+void BenchmarkParallelProcess() {
+  const int request_count = 1'000'000;
+  auto doc = Json::LoadFromBuffer(MakeInput(50'000, 5'000, 50, 0));
+  RouteManager rm(doc);
+
+  vector<Json::Node> requests;
+  requests.reserve(request_count);
+  for (int i = 0; i < request_count; ++i) {
+    map<string, Json::Node> request{{"id", Json::Node(i)}};
+    if (i % 2) {
+      request["type"] = Json::Node("Bus"s);
+      request["name"] = Json::Node("Bus " + to_string(i % 5'010));
+    } else {
+      request["type"] = Json::Node("Stop"s);
+      request["name"] = Json::Node("Stop " + to_string(i % 50'000));
+    }
+    requests.push_back(Json::Node(move(request)));
+  }
+  Json::Document queries(Json::Node(map<string, Json::Node>{
+      {"stat_requests", Json::Node(move(requests))}}));
+
+  size_t max_threads = max(thread::hardware_concurrency(), 4u);
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    LOG_DURATION("1M requests on " + to_string(threads) + " threads");
+    rm.Process(queries, threads);
+  }
+}
+
+void BenchmarkLoadText() {
+  const string input = MakeTextInput(100'000, 10'000, 50, 0);
+  {
+    LOG_DURATION("Text load from stream");
+    istringstream is(input);
+    RouteManager().Process(is);
+  }
+  {
+    LOG_DURATION("Text load from buffer");
+    RouteManager rm;
+    rm.LoadText(input);
+  }
+}
+
+void BenchmarkSnapshotStartup() {
+  const string input = MakeInput(100'000, 10'000, 50, 0);
+  const auto path = filesystem::temp_directory_path() / "route_manager.snap";
+  RouteManager rm;
+  {
+    LOG_DURATION("Startup from JSON");
+    rm.Load(Json::LoadArenaFromBuffer(input));
+  }
+  rm.SaveSnapshot(path);
+  {
+    LOG_DURATION("Startup from snapshot");
+    RouteSnapshot snapshot(path);
+  }
+  filesystem::remove(path);
+}
+
+void BenchmarkGeoLengths() {
+  auto coords = MakeRoute(1'000'000);
+  double pairwise = 0, batch = 0;
+  {
+    LOG_DURATION("Pairwise geo length of 1M stops");
+    for (size_t i = 0; i + 1 < coords.size(); ++i)
+      pairwise += CalculateGeoLength(coords[i], coords[i + 1]);
+  }
+  {
+    GeoRoute route;
+    route.Reserve(coords.size());
+    for (auto c : coords) route.Add(ToGeoTrig(c));
+    LOG_DURATION("Batch geo length of 1M stops");
+    vector<double> lengths;
+    CalculateGeoLengths(route, lengths);
+    batch = accumulate(lengths.begin(), lengths.end(), 0.0);
+  }
+  ASSERT(abs(pairwise - batch) <= 1e-9 * pairwise);
+}
+
+int main() {
+  TestRunner tr;
+  RUN_TEST(tr, TestTreeLoad);
+  RUN_TEST(tr, TestStreamLoad);
+  RUN_TEST(tr, TestNodeBuilder);
+  RUN_TEST(tr, TestLoadFromBuffer);
+  RUN_TEST(tr, TestScanStructure);
+  RUN_TEST(tr, TestArenaLoad);
+  RUN_TEST(tr, TestLoadTruncated);
+  RUN_TEST(tr, TestWriter);
+  RUN_TEST(tr, TestParallelProcess);
+  RUN_TEST(tr, TestGeoLengths);
+  RUN_TEST(tr, TestLoadText);
+  RUN_TEST(tr, TestStopBuses);
+  RUN_TEST(tr, TestDuplicateDistance);
+  RUN_TEST(tr, TestBulkStopLoad);
+  RUN_TEST(tr, TestStopErrorsAfterLoad);
+  RUN_TEST(tr, TestMissingDistance);
+  RUN_TEST(tr, TestSnapshot);
+  RUN_TEST(tr, TestRouteService);
+  RUN_TEST(tr, TestRouteServiceStress);
+  RUN_TEST(tr, BenchmarkLoad);
+  RUN_TEST(tr, BenchmarkParallelProcess);
+  RUN_TEST(tr, BenchmarkGeoLengths);
+  RUN_TEST(tr, BenchmarkLoadText);
+  RUN_TEST(tr, BenchmarkSnapshotStartup);
+  return 0;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Fixed set of threads that stay alive between ParallelFor calls, so a call
+// does not pay for starting threads. The calling thread runs tasks too.
+class WorkerPool {
+ public:
+  explicit WorkerPool(size_t thread_count);
+  ~WorkerPool();
+
+  size_t Size() const { return threads_.size(); }
+  // Calls f(i) for every i in [0, count) and returns when all calls are
+  // done. The first exception thrown by f is rethrown. Concurrent calls run
+  // one after another.
+  void ParallelFor(size_t count, const std::function<void(size_t)>& f);
+
+ private:
+  void Work();
+  // Takes tasks of the current call until none is left, m_ is held by lock
+  // between tasks
+  void RunTasks(std::unique_lock<std::mutex>& lock);
+
+  std::mutex call_m_;
+  std::mutex m_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  const std::function<void(size_t)>* job_ = nullptr;
+  size_t next_ = 0;
+  size_t count_ = 0;
+  size_t done_ = 0;
+  uint64_t generation_ = 0;
+  std::exception_ptr error_;
+  bool stopping_ = false;
+  // Last, so that the threads start once everything else is set up
+  std::vector<std::thread> threads_;
+};
+
+WorkerPool::WorkerPool(size_t thread_count) {
+  threads_.reserve(thread_count);
+  for (size_t i = 0; i < thread_count; ++i)
+    threads_.emplace_back([this] { Work(); });
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard lock(m_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& thread : threads_) thread.join();
+}
+
+void WorkerPool::ParallelFor(size_t count,
+                             const std::function<void(size_t)>& f) {
+  std::lock_guard call_lock(call_m_);
+  std::unique_lock lock(m_);
+  job_ = &f;
+  next_ = done_ = 0;
+  count_ = count;
+  ++generation_;
+  work_cv_.notify_all();
+
+  RunTasks(lock);
+  done_cv_.wait(lock, [this] { return done_ == count_; });
+  job_ = nullptr;
+  if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+}
+
+void WorkerPool::RunTasks(std::unique_lock<std::mutex>& lock) {
+  while (next_ < count_) {
+    size_t i = next_++;
+    auto& f = *job_;
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+      f(i);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    lock.lock();
+    if (error && !error_) error_ = error;
+    if (++done_ == count_) done_cv_.notify_all();
+  }
+}
+
+void WorkerPool::Work() {
+  std::unique_lock lock(m_);
+  uint64_t seen = 0;
+  while (true) {
+    work_cv_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+    if (stopping_) return;
+    seen = generation_;
+    RunTasks(lock);
+  }
+}
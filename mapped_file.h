@@ -0,0 +1,62 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Read-only memory mapping of a whole file, unmapped on destruction
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      Fail("open", path, errno);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      int error = errno;
+      close(fd);
+      Fail("fstat", path, error);
+    }
+    size = st.st_size;
+    if (size > 0) {
+      data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        Fail("mmap", path, error);
+      }
+      madvise(data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (size > 0) {
+      munmap(data, size);
+    }
+  }
+
+  std::string_view Data() const {
+    return {static_cast<const char*>(data), size};
+  }
+
+private:
+  [[noreturn]] static void Fail(const std::string& call,
+                                const std::string& path, int error) {
+    throw std::runtime_error(call + " " + path + ": " + std::strerror(error));
+  }
+
+  void* data = nullptr;
+  size_t size = 0;
+};